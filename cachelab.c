@@ -1,15 +1,26 @@
 /*
  * cachelab.c - Cache Lab helper functions
  */
+#define _GNU_SOURCE /* posix_memalign, madvise */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include "cachelab.h"
-#include <time.h>
+#include <sys/mman.h>
 
 trans_func_t func_list[MAX_TRANS_FUNCS];
 int func_counter = 0; 
 
+/* Shapes the transpose functions are checked on, see cachelab.h */
+int check_shapes[NUM_CHECK_SHAPES][2] = {{1, 1}, {2, 3}, {8, 8}, {32, 32}, {48, 48},
+                                         {40, 24}, {24, 40}, {61, 67}, {100, 37}};
+
+/* Threads of the parallel transpose functions */
+int trans_threads = 1;
+
+/* Seed of the matrix contents, fixed so that runs are repeatable */
+static unsigned int matrix_seed = 1;
+
 /* 
  * printSummary - Summarize the cache simulation statistics. Student cache simulators
  *                must call this function in order to be properly autograded. 
@@ -40,13 +51,46 @@ void printSummary(int hits,
     fclose(output_fp);
 }
 
+/*
+ * setMatrixSeed - Seed used by initMatrix and randMatrix from now on
+ */
+void setMatrixSeed(unsigned int seed)
+{
+    matrix_seed = seed;
+}
+
+/*
+ * allocMatrix - Allocate an M x N int matrix starting at a multiple of
+ *     align bytes (a power of two, at least sizeof(void*)). With huge the
+ *     matrix is also aligned to and padded to whole huge pages, which the
+ *     kernel is asked to back it with. NULL when out of memory.
+ */
+void* allocMatrix(int M, int N, size_t align, int huge)
+{
+    size_t size = sizeof(int) * (size_t) M * N;
+    void* matrix;
+
+    if (huge) {
+        if (align < HUGE_PAGE_SIZE)
+            align = HUGE_PAGE_SIZE;
+        size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+    }
+    if (posix_memalign(&matrix, align, size > 0 ? size : 1) != 0)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (huge && madvise(matrix, size, MADV_HUGEPAGE) != 0)
+        fprintf(stderr, "Warning: no huge pages for a %dx%d matrix\n", M, N);
+#endif
+    return matrix;
+}
+
 /* 
  * initMatrix - Initialize the given matrix 
  */
 void initMatrix(int M, int N, int A[N][M], int B[M][N])
 {
     int i, j;
-    srand(time(NULL));
+    srand(matrix_seed);
     for (i = 0; i < N; i++){
         for (j = 0; j < M; j++){
             // A[i][j] = i+j;  /* The matrix created this way is symmetric */
@@ -58,7 +102,7 @@ void initMatrix(int M, int N, int A[N][M], int B[M][N])
 
 void randMatrix(int M, int N, int A[N][M]) {
     int i, j;
-    srand(time(NULL));
+    srand(matrix_seed);
     for (i = 0; i < N; i++){
         for (j = 0; j < M; j++){
             // A[i][j] = i+j;  /* The matrix created this way is symmetric */
@@ -96,5 +140,30 @@ void registerTransFunction(void (*trans)(int M, int N, int[N][M], int[M][N]),
     func_list[func_counter].num_hits = 0;
     func_list[func_counter].num_misses = 0;
     func_list[func_counter].num_evictions =0;
+    func_list[func_counter].parallel = 0;
+    func_list[func_counter].in_place = 0;
     func_counter++;
 }
+
+/*
+ * registerParallelTransFunction - Like registerTransFunction, for a
+ *     function that runs on trans_threads threads
+ */
+void registerParallelTransFunction(void (*trans)(int M, int N, int[N][M], int[M][N]),
+                                   char* desc)
+{
+    registerTransFunction(trans, desc);
+    func_list[func_counter - 1].parallel = 1;
+}
+
+/*
+ * registerInPlaceTransFunction - Like registerTransFunction, for a
+ *     function that transposes B in place. The caller copies A into B
+ *     first, the function must not touch A.
+ */
+void registerInPlaceTransFunction(void (*trans)(int M, int N, int[N][M], int[M][N]),
+                                  char* desc)
+{
+    registerTransFunction(trans, desc);
+    func_list[func_counter - 1].in_place = 1;
+}
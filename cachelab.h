@@ -5,8 +5,16 @@
 #ifndef CACHELAB_TOOLS_H
 #define CACHELAB_TOOLS_H
 
+#include <stddef.h>
+
 #define MAX_TRANS_FUNCS 100
 
+/* Most threads a parallel transpose function uses */
+#define MAX_TRANS_THREADS 256
+
+/* Size and alignment of the huge pages allocMatrix asks for */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 typedef struct trans_func{
   void (*func_ptr)(int M,int N,int[N][M],int[M][N]);
   char* description;
@@ -14,6 +22,8 @@ typedef struct trans_func{
   unsigned int num_hits;
   unsigned int num_misses;
   unsigned int num_evictions;
+  char parallel; /* runs on trans_threads threads */
+  char in_place; /* transposes B, which holds a copy of A, in place */
 } trans_func_t;
 
 /* 
@@ -27,6 +37,13 @@ void printSummary(int hits,  /* number of  hits */
 		  int dirty_active, /* number of dirty bytes active */
 		  int double_accesses); /* number of double accesses */
 
+/* Heap allocate a matrix aligned to align bytes, on huge pages if huge.
+   Release it with free(). */
+void* allocMatrix(int M, int N, size_t align, int huge);
+
+/* Seed for initMatrix, the default is fixed so that runs are repeatable */
+void setMatrixSeed(unsigned int seed);
+
 /* Fill the matrix with data */
 void initMatrix(int M, int N, int A[N][M], int B[M][N]);
 
@@ -37,4 +54,21 @@ void correctTrans(int M, int N, int A[N][M], int B[M][N]);
 void registerTransFunction(
     void (*trans)(int M,int N,int[N][M],int[M][N]), char* desc);
 
+/* Small and ragged shapes (M, N) every function is checked on by
+   test-trans -T and tracegen -V */
+#define NUM_CHECK_SHAPES 9
+extern int check_shapes[NUM_CHECK_SHAPES][2];
+
+/* Threads the parallel transpose functions use (1 to MAX_TRANS_THREADS) */
+extern int trans_threads;
+
+/* Add a function that runs on trans_threads threads */
+void registerParallelTransFunction(
+    void (*trans)(int M,int N,int[N][M],int[M][N]), char* desc);
+
+/* Add a function that transposes B in place, B is made a copy of A
+   before it is called */
+void registerInPlaceTransFunction(
+    void (*trans)(int M,int N,int[N][M],int[M][N]), char* desc);
+
 #endif /* CACHELAB_TOOLS_H */
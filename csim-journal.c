@@ -0,0 +1,318 @@
+/*
+ * csim-journal.c - inspects an event journal written by csim --journal.
+ *
+ * Without options it prints the journal's geometry and event counts.
+ * -r <record> rebuilds the cache state after that trace record from the
+ * nearest keyframe before it, -e <first>:<last> lists the events of a
+ * range of records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "journal.h"
+
+typedef struct
+{
+    int valid;
+    int dirty;
+    uint64_t tag;
+} line_state_t;
+
+typedef struct
+{
+    FILE* fp;
+    journal_header_t header;
+    journal_trailer_t trailer;
+    journal_keyframe_t* keyframes;
+} journal_file_t;
+
+const char* kind_names[] = {"?", "fill", "evict", "dirty", "keyframe"};
+
+void
+printUsage()
+{
+    printf("Usage: ./csim-journal -j <journal> [-r <record>] [-e <first>:<last>]\n");
+    printf("-j <journal>: journal written by csim --journal\n");
+    printf("-r <record>: print the valid lines after this trace record\n");
+    printf("-e <first>:<last>: list the events of these trace records\n");
+}
+
+//openJournal - reads header, trailer and keyframe index
+int
+openJournal(
+    char* path,
+    journal_file_t* journal
+) {
+    journal->fp = fopen(path, "rb");
+    if (journal->fp == NULL) {
+        printf("Error: failed to open journal - %s\n", path);
+        return 1;
+    }
+    if (fread(&journal->header, sizeof(journal->header), 1, journal->fp) != 1
+            || memcmp(journal->header.magic, JOURNAL_MAGIC, 8) != 0
+            || fseek(journal->fp, -(long) sizeof(journal->trailer), SEEK_END) != 0
+            || fread(&journal->trailer, sizeof(journal->trailer), 1, journal->fp) != 1
+            || memcmp(journal->trailer.magic, JOURNAL_TRAILER_MAGIC, 8) != 0) {
+        printf("Error: not a complete journal - %s\n", path);
+        return 1;
+    }
+    //s and E size the state printState allocates
+    if (journal->header.s < 0 || journal->header.s > 32
+            || journal->header.E < 1 || journal->header.E > JOURNAL_MAX_WAYS) {
+        printf("Error: bad geometry s=%d E=%d - %s\n", journal->header.s,
+               journal->header.E, path);
+        return 1;
+    }
+    journal->keyframes = calloc(journal->trailer.num_keyframes + 1,
+                                sizeof(journal_keyframe_t));
+    if (journal->keyframes == NULL
+            || fseek(journal->fp, journal->trailer.index_offset, SEEK_SET) != 0
+            || fread(journal->keyframes, sizeof(journal_keyframe_t),
+                     journal->trailer.num_keyframes, journal->fp)
+               != journal->trailer.num_keyframes) {
+        printf("Error: failed to read keyframe index - %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+//seekKeyframe - positions the journal at the last keyframe at or before
+//record, returns its index or -1 if the journal starts after record
+long long
+seekKeyframe(
+    journal_file_t* journal,
+    uint64_t record
+) {
+    long long low = 0;
+    long long high = (long long) journal->trailer.num_keyframes - 1;
+    long long found = -1;
+
+    while (low <= high) {
+        long long mid = (low + high) / 2;
+        if (journal->keyframes[mid].record <= record) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    if (found >= 0) {
+        fseek(journal->fp, journal->keyframes[found].offset, SEEK_SET);
+    }
+    return found;
+}
+
+//readEvent - next event before the keyframe index, 0 at its end
+int
+readEvent(
+    journal_file_t* journal,
+    journal_event_t* event
+) {
+    if ((uint64_t) ftell(journal->fp) >= journal->trailer.index_offset) {
+        return 0;
+    }
+    return fread(event, sizeof(*event), 1, journal->fp) == 1;
+}
+
+//applyEvent - changes the line of the event, 1 if it is not a line of
+//the journal's cache or of an unknown kind
+int
+applyEvent(
+    line_state_t* lines,
+    uint64_t S,
+    int E,
+    journal_event_t* event
+) {
+    line_state_t* line;
+
+    if (event->set >= S || event->way >= E
+            || event->kind < JOURNAL_FILL || event->kind > JOURNAL_DIRTY) {
+        return 1;
+    }
+    line = &lines[(uint64_t) event->set * E + event->way];
+
+    switch (event->kind) {
+    case JOURNAL_FILL:
+        line->valid = 1;
+        line->tag = event->tag;
+        line->dirty = event->dirty;
+        break;
+    case JOURNAL_EVICT:
+        line->valid = 0;
+        line->dirty = 0;
+        break;
+    case JOURNAL_DIRTY:
+        line->dirty = event->dirty;
+        break;
+    }
+    return 0;
+}
+
+//printState - rebuilds and prints the cache after record
+int
+printState(
+    journal_file_t* journal,
+    uint64_t record
+) {
+    uint64_t S = 1ULL << journal->header.s;
+    int E = journal->header.E;
+    line_state_t* lines;
+    journal_event_t event;
+
+    if (seekKeyframe(journal, record) < 0) {
+        printf("Error: the journal starts after record %llu\n",
+               (unsigned long long) record);
+        return 1;
+    }
+    lines = calloc(S * E, sizeof(line_state_t));
+    if (lines == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    //a keyframe replaces the whole state, later events change it
+    while (readEvent(journal, &event) && event.record <= record) {
+        if (event.kind == JOURNAL_KEYFRAME) {
+            memset(lines, 0, S * E * sizeof(line_state_t));
+        } else if (applyEvent(lines, S, E, &event) != 0) {
+            printf("Error: bad event of record %llu\n",
+                   (unsigned long long) event.record);
+            free(lines);
+            return 1;
+        }
+    }
+    printf("state after record %llu\n", (unsigned long long) record);
+    printf("set\tway\ttag\tdirty\n");
+    for (uint64_t i = 0; i < S; i++) {
+        for (int j = 0; j < E; j++) {
+            line_state_t* line = &lines[i * E + j];
+            if (line->valid) {
+                printf("%llu\t%d\t%llx\t%d\n", (unsigned long long) i, j,
+                       (unsigned long long) line->tag, line->dirty);
+            }
+        }
+    }
+    free(lines);
+    return 0;
+}
+
+//printEvents - the events of records first to last, keyframes left out
+int
+printEvents(
+    journal_file_t* journal,
+    uint64_t first,
+    uint64_t last
+) {
+    journal_event_t event;
+    uint64_t skip = 0; //fills of the keyframe being read
+
+    if (seekKeyframe(journal, first) < 0) {
+        fseek(journal->fp, sizeof(journal->header), SEEK_SET);
+    }
+    printf("record\tevent\tset\tway\ttag\tdirty\n");
+    while (readEvent(journal, &event) && event.record <= last) {
+        if (event.kind == JOURNAL_KEYFRAME) {
+            skip = event.tag;
+            continue;
+        }
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        if (event.record >= first && event.kind < 4) {
+            printf("%llu\t%s\t%u\t%u\t%llx\t%d\n", (unsigned long long) event.record,
+                   kind_names[event.kind], event.set, event.way,
+                   (unsigned long long) event.tag, event.dirty);
+        }
+    }
+    return 0;
+}
+
+//printCounts - events of each kind in the whole journal
+int
+printCounts(
+    journal_file_t* journal
+) {
+    long long counts[5] = {0};
+    uint64_t last = 0;
+    journal_event_t event;
+    uint64_t skip = 0;
+
+    fseek(journal->fp, sizeof(journal->header), SEEK_SET);
+    while (readEvent(journal, &event)) {
+        if (event.kind == JOURNAL_KEYFRAME) {
+            skip = event.tag;
+        } else if (skip > 0) {
+            skip--;
+            continue;
+        }
+        if (event.kind <= JOURNAL_KEYFRAME) {
+            counts[event.kind]++;
+        }
+        last = event.record;
+    }
+    printf("s=%d E=%d b=%d keyframe_every=%llu last_record=%llu\n",
+           journal->header.s, journal->header.E, journal->header.b,
+           (unsigned long long) journal->header.keyframe_every,
+           (unsigned long long) last);
+    printf("fills:%lld evictions:%lld dirty:%lld keyframes:%lld\n",
+           counts[JOURNAL_FILL], counts[JOURNAL_EVICT], counts[JOURNAL_DIRTY],
+           counts[JOURNAL_KEYFRAME]);
+    return 0;
+}
+
+int
+main(
+    int argc,
+    char* argv[]
+) {
+    journal_file_t journal = {0};
+    char* path = NULL;
+    char* range = NULL;
+    char* record = NULL;
+    unsigned long long first;
+    unsigned long long last;
+    int result;
+    int c;
+
+    while ((c = getopt(argc, argv, "j:r:e:h")) != -1) {
+        switch (c) {
+        case 'j':
+            path = optarg;
+            break;
+        case 'r':
+            record = optarg;
+            break;
+        case 'e':
+            range = optarg;
+            break;
+        case 'h':
+            printUsage();
+            exit(0);
+        default:
+            printUsage();
+            exit(-1);
+        }
+    }
+    if (path == NULL) {
+        printUsage();
+        exit(-1);
+    }
+    if (openJournal(path, &journal) != 0) {
+        exit(1);
+    }
+    if (record != NULL) {
+        result = printState(&journal, strtoull(record, NULL, 10));
+    } else if (range != NULL) {
+        if (sscanf(range, "%llu:%llu", &first, &last) != 2) {
+            printf("Error: expected <first>:<last> - %s\n", range);
+            exit(-1);
+        }
+        result = printEvents(&journal, first, last);
+    } else {
+        result = printCounts(&journal);
+    }
+    fclose(journal.fp);
+    free(journal.keyframes);
+    return result;
+}
@@ -1,4 +1,7 @@
+#define _GNU_SOURCE //mmap/madvise flags under -std=c99
 #include "cachelab.h"
+#include "journal.h"
+#include "csim.h"
 #include <stdlib.h>
 #include <getopt.h>
 #include <strings.h>
@@ -6,12 +9,85 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#define CSIM_VERSION "2" //bump when simulation results change
 #define MEMADDR_BITSIZE 64
-#define DEBUG_FILE_PATH "csim-debug.log"
+#define ARENA_ALIGN (2UL << 20) //huge page size
+#define JOURNAL_BUFFER_EVENTS 65536 //events handed to the writer at a time
 
 #define ERROR_OPEN_FILE 2
 #define ERROR_CACHE_LINE_NOT_FOUND 3
+#define ERROR_INIT_CACHE 4
+#define ERROR_BAD_MANIFEST 5
+#define ERROR_SNAPSHOT 6
+#define ERROR_BAD_OPTION 7
+#define ERROR_TRACE_INDEX 8
+
+//sampleUnit results that are not a unit index
+#define SAMPLE_NONE -1 //simulate, but do not count towards any unit
+#define SAMPLE_SKIP -2 //do not simulate at all
+
+#define RESULT_CACHE_ENV "CSIM_RESULT_CACHE"
+
+//long options that take an argument
+enum {
+    OPT_BATCH = 256,
+    OPT_THREADS,
+    OPT_RESULT_CACHE,
+    OPT_CHECKPOINT,
+    OPT_CHECKPOINT_EVERY,
+    OPT_RESUME,
+    OPT_WARM,
+    OPT_COUNT,
+    OPT_SAMPLE_SETS,
+    OPT_SAMPLE_INTERVALS,
+    OPT_CONFIDENCE,
+    OPT_PREFETCH,
+    OPT_PREFETCH_DEGREE,
+    OPT_PREFETCH_LATENCY,
+    OPT_STREAM_BUFFERS,
+    OPT_WRITE_THROUGH,
+    OPT_NO_WRITE_ALLOCATE,
+    OPT_WRITE_BUFFER,
+    OPT_VICTIM_CACHE,
+    OPT_HIT_LATENCY,
+    OPT_MISS_PENALTY,
+    OPT_BANDWIDTH,
+    OPT_MSHRS,
+    OPT_VICTIM_LATENCY,
+    OPT_TLB,
+    OPT_PAGE_SIZE,
+    OPT_WALK_LATENCY,
+    OPT_TLB_L2_LATENCY,
+    OPT_PWC,
+    OPT_SPLIT_ACCESSES,
+    OPT_SECTORS,
+    OPT_INDEX,
+    OPT_SETS,
+    OPT_ICACHE,
+    OPT_L2,
+    OPT_L2_LATENCY,
+    OPT_TRACES,
+    OPT_QUANTUM,
+    OPT_CAT,
+    OPT_JOURNAL,
+    OPT_KEYFRAME_EVERY,
+    OPT_TRACE_INDEX,
+    OPT_TRACE_INDEX_EVERY,
+    OPT_RANGE,
+    OPT_RANGE_WARMUP,
+    OPT_RANGES,
+    OPT_REPORT
+};
+
+typedef unsigned long long memaddr_t; 
 
 typedef struct
 {
@@ -23,22 +99,17 @@ typedef struct
     int double_accesses;
 } metrics_t;
 
-//Struct for cache parameters 
-typedef struct 
+//estimates of the metrics_t counts for a whole sampled trace, which can
+//exceed an int
+typedef struct
 {
-    int s; //2^s cache sets 
-    int b; //2^b bytes per line for cache block 
-    int E; //cache lines per set 
-    int S; //S = 2^s, number of cache sets 
-    int B; //B = 2^b, cache line block size 
-    int t; //number of bits in tag = 64 - s - b    
-
-    metrics_t metrics;
-
-    unsigned long long counter; // use for LRU
-} param_t; 
-
-typedef unsigned long long memaddr_t; 
+    long long hitcount;
+    long long misscount;
+    long long evictcount;
+    long long dirty_evicted;
+    long long dirty_active;
+    long long double_accesses;
+} estimate_t;
 
 //struct to represent all data in a set line in a cache 
 typedef struct 
@@ -49,6 +120,13 @@ typedef struct
     char *block; 
     
     unsigned long long access; 
+
+    int prefetched; //filled by a prefetch and not referenced since
+    int asid; //trace the line belongs to when several share the cache
+    unsigned long long ready; //counter value at which a prefetch completes
+
+    unsigned long long sector_valid; //bit i for sector i, sectored caches only
+    unsigned long long sector_dirty;
 } cache_line_t; 
 
 //pointer for lines in cache to singular line 
@@ -62,10 +140,455 @@ typedef struct
 typedef struct 
 {
     cache_set_t *sets; 
+    cache_line_t *lines; //all lines, set i owns lines[i*E .. i*E+E-1]
+    unsigned long long *packed; //bit-packed lines in compact mode
+    void *arena; //single mapping holding sets and lines, or packed
+    size_t arena_size;
+    long long materialized; //number of sets touched so far in lazy mode
 } cache_t;
 
+//compact mode packs every line as [tag:t][valid:1][dirty:1][rank:r],
+//r = ceil(log2(E)). rank is the LRU position of a valid line in its set,
+//0 for the most recently used one.
+#define COMPACT_VALID 1ULL
+#define COMPACT_DIRTY 2ULL
+#define COMPACT_RANK_SHIFT 2
+
+//front-end filter: collapses a run of references to the block that was
+//referenced last, those are always hits on the MRU line of its set
+typedef struct
+{
+    memaddr_t block;            //block address (memaddr >> b) of the run
+    cache_line_t* line;         //line holding the block, NULL when no run
+    long long slot;             //same in compact mode: set * E + way, or -1
+    int hits;                   //hits of the run not yet added to metrics
+    unsigned long long access;  //counter of the latest reference in the run
+} filter_t;
+
+//prefetchers, see prefetchAccess()
+#define PREFETCH_NONE 0
+#define PREFETCH_NEXT_LINE 1
+#define PREFETCH_STRIDE 2
+#define PREFETCH_STREAM 3
+#define PREFETCH_AMPM 4
+
+#define STRIDE_TABLE_SIZE 64 //regions tracked by the stride prefetcher
+#define STRIDE_REGION_BITS 12 //a region is a 4KB page
+#define AMPM_ZONES 64 //zones tracked by the AMPM prefetcher
+#define AMPM_ZONE_LINES 64 //lines per zone
+#define AMPM_MAX_STRIDE 16 //strides AMPM looks for
+#define POLLUTION_FILTER_SIZE 4096 //blocks evicted by prefetches
+
+//AMPM line states
+#define AMPM_INIT 0
+#define AMPM_ACCESS 1
+#define AMPM_PREFETCH 2
+
+typedef struct
+{
+    long long issued; //prefetches that filled a line (or stream buffer entry)
+    long long used; //prefetched lines referenced by a demand access
+    long long late; //of those, referenced before the prefetch completed
+    long long evictions; //lines evicted to make room for prefetches
+    long long pollution; //of those, lines missed on again by demand
+    long long writeback_bytes; //dirty bytes those evictions wrote back
+} prefetch_stats_t;
+
+typedef struct
+{
+    memaddr_t region;
+    memaddr_t last_block;
+    long long stride;
+    int confidence; //0..3, prefetches are issued from 2 on
+    int valid;
+} stride_entry_t;
+
+//a stream buffer holds blocks first .. first+count-1, the ready time of
+//block x is kept in ready[x % depth]
+typedef struct
+{
+    memaddr_t first;
+    int count;
+    unsigned long long* ready;
+    unsigned long long access; //for LRU replacement of buffers
+} stream_buffer_t;
+
+typedef struct
+{
+    memaddr_t zone;
+    int valid;
+    unsigned char state[AMPM_ZONE_LINES];
+    unsigned long long access;
+} ampm_zone_t;
+
+typedef struct
+{
+    int kind;
+    int degree; //prefetches per trigger, stream buffer depth
+    int latency; //accesses until a prefetch completes
+    int num_buffers; //stream buffers
+    prefetch_stats_t stats;
+    stride_entry_t* strides;
+    stream_buffer_t* buffers;
+    ampm_zone_t* zones;
+    memaddr_t* pollution; //block + 1 of evicted lines, 0 for empty
+} prefetcher_t;
+
+//line of the fully associative victim cache
+typedef struct
+{
+    memaddr_t block;
+    int validbit;
+    int dirtybit;
+    unsigned long long access;
+} victim_line_t;
+
+//write buffer entry, mask has a bit for every byte of the block written
+typedef struct
+{
+    memaddr_t block;
+    unsigned char* mask;
+    int bytes; //bits set in mask
+} write_entry_t;
+
+//write policies, see policyAccess(). Without any of them set updateCache
+//does write-back, write-allocate with nothing behind the cache.
+typedef struct
+{
+    int enabled; //any of the below set
+    int write_through; //stores go to memory, lines are never dirty
+    int no_write_allocate; //store misses do not fill a line
+    int buffer_entries; //coalescing write buffer, 0 for none
+    int victim_lines; //victim cache, 0 for none
+    write_entry_t* buffer; //FIFO ring of buffer_entries
+    int buffer_head;
+    int buffer_count;
+    victim_line_t* victims;
+    long long memory_bytes; //bytes written to memory
+    long long memory_writes; //write transactions to memory
+    long long coalesced; //writes merged into a buffered block
+    long long victim_hits; //misses served by the victim cache
+} write_policy_t;
+
+//miss status holding register, a miss whose fill is outstanding
+typedef struct
+{
+    memaddr_t block;
+    unsigned long long done; //cycle the fill completes
+} mshr_t;
+
+//latency model, see timeRecord(). References issue in order, one every
+//hit_latency cycles. A miss occupies the memory bus for B / bandwidth
+//cycles and completes miss_penalty cycles after it got the bus.
+typedef struct
+{
+    int enabled;
+    int hit_latency;
+    int miss_penalty;
+    int bandwidth; //bytes per cycle between cache and memory, 0 unlimited
+    int mshrs; //misses that may be outstanding, 0 for a blocking cache
+    int victim_latency; //extra cycles of a miss served by the victim cache
+    int l2_latency; //extra cycles of an L1 miss served by the L2
+    mshr_t* pending;
+    unsigned long long clock;
+    unsigned long long bus_free; //cycle the memory bus is free again
+    long long refs;
+    long long victim_seen; //victim cache hits already timed
+    long long l2_seen; //L2 hits already timed
+    long long written_seen; //memory write bytes already timed
+    long long prefetch_written_seen; //prefetch write-back bytes already timed
+} timing_t;
+
+//x86-64 page tables: 4 levels of 9 bits each above the 4K page offset.
+//A 2M page ends the walk one level early, a 1G page two levels early.
+#define PAGE_TABLE_LEVELS 4
+#define PAGE_TABLE_BITS 9
+#define PAGE_BITS_4K 12
+
+typedef struct
+{
+    memaddr_t tag; //page number, for the walk cache level and prefix
+    int valid;
+    unsigned long long access;
+} tlb_entry_t;
+
+//one level of TLB, or the page walk cache. Set associative with LRU,
+//entries / ways sets.
+typedef struct
+{
+    int entries; //0 for no such level
+    int ways;
+    int sets;
+    tlb_entry_t* lines;
+    long long hits;
+    long long misses;
+} tlb_level_t;
+
+typedef struct
+{
+    int enabled;
+    int page_bits; //12, 21 or 30
+    int walk_latency; //cycles of one page table access
+    int l2_latency; //cycles of an L1 TLB miss that hits in the L2 TLB
+    tlb_level_t l1;
+    tlb_level_t l2;
+    tlb_level_t pwc; //non-leaf page table entries, fully associative
+    long long walks;
+    long long walk_refs; //page table entries read by walks
+    unsigned long long walk_cycles;
+    unsigned long long tick; //LRU clock, one tick per lookup
+} tlb_t;
+
+//set index functions, see hashIndex()
+#define INDEX_MODULO 0 //block mod S, bit selection for S = 2^s
+#define INDEX_XOR 1 //block folded onto itself with xor, then mod S
+#define INDEX_PRIME 2 //block mod the largest prime <= S
+#define INDEX_SKEW 3 //a different hash for every way
+
+//geometry of an additional cache level, E = 0 for none
+typedef struct
+{
+    int s;
+    int E;
+    int b;
+} geometry_t;
+
+//result of one range of --ranges, error is the job's result
+typedef struct
+{
+    long long start;
+    long long end;
+    int error;
+    metrics_t metrics;
+} range_row_t;
+
+struct level;
+struct journal;
+struct trace_index;
+
+//Struct for cache parameters 
+typedef struct param
+{
+    int s; //2^s cache sets 
+    int b; //2^b bytes per line for cache block 
+    int E; //cache lines per set 
+    int S; //S = 2^s, number of cache sets 
+    int B; //B = 2^b, cache line block size 
+    int t; //number of bits in tag = 64 - s - b    
+
+    int compact; //use bit-packed lines instead of cache_line_t
+    int lazy; //set up a set on its first access instead of in init()
+    char* result_cache; //directory of stored results, NULL for none
+
+    char* checkpoint; //snapshot written every checkpoint_every records and at the end
+    long long checkpoint_every;
+    char* restore; //snapshot to start from, NULL to start cold
+    int warm; //take only the cache state from restore, count from zero
+    long long max_records; //stop after this many records, 0 for no limit
+    long trace_offset; //where the trace is read from, set by restore
+
+    //ranges: only records [range_start, range_end) of the trace are
+    //counted, after range_warmup records simulated uncounted. The trace
+    //index (see loadTraceIndex()) finds the first of them without
+    //reading the trace from its start.
+    long long range_start;
+    long long range_end; //0 for the end of the trace
+    long long range_warmup;
+    long long index_every; //records per block of the trace index
+    struct trace_index* trace_index; //shared by the jobs of --ranges, NULL
+                                     //for seekRecord to load it itself
+    range_row_t* range_rows; //results of --ranges, kept for the report
+    int num_range_rows;
+
+    //sampling, the metrics are extrapolated from sampling units: sets
+    //for set sampling, detailed windows for interval sampling
+    int sample_sets; //simulate only sets whose hash is 0 mod sample_sets
+    long long window; //records of a detailed window, 0 for no intervals
+    long long warmup; //records simulated uncounted before a window, -1 all
+    long long period; //records from the start of one window to the next
+    double confidence; //of the reported intervals, e.g. 0.95
+    metrics_t* units; //metrics of each unit
+    long long num_units;
+    size_t units_size; //bytes mapped for units in set sampling
+    long long refs; //cache references in the trace, sampled or not
+    long long sampled; //units the estimate is based on
+    estimate_t estimate; //whole trace estimates of a sampled run
+    estimate_t error; //half widths of the confidence intervals
+
+    prefetcher_t prefetch;
+    write_policy_t writes;
+    timing_t timing;
+    tlb_t tlb;
+
+    int split_accesses; //a record counts against every block it touches
+    int access_size; //bytes of the access being simulated
+    int index_kind; //INDEX_*
+    int hashed; //index_kind or num_sets other than bit selection
+    long long num_sets; //sets if not 2^s, 0 for 2^s
+    int index_bits; //bits folded at a time by INDEX_XOR
+    long long modulus; //prime of INDEX_PRIME
+    int sectors; //sectors per line, 0 for an unsectored cache
+    int sector_bits; //log2 of the bytes of a sector
+    long long sector_misses; //tag hits on a sector that was not there
+    long long fetched_bytes; //bytes read from memory by a sectored cache
+
+    //split L1: 'I' records go to an I-cache, the cache this struct
+    //describes is the L1 D-cache. L1 misses of both go to a unified L2.
+    geometry_t icache_geometry;
+    geometry_t l2_geometry;
+    struct level* icache; //set up by simulate() for the run
+    struct level* l2;
+    metrics_t icache_metrics; //kept after the levels are freed
+    metrics_t l2_metrics;
+    long long l2_fetch_hits; //L1 misses served by the L2
+
+    //multiprogramming: traces take turns of quantum records on the cache,
+    //their lines are told apart by address-space ID (the trace index)
+    char** traces;
+    int num_traces;
+    long long quantum;
+    int asid; //trace being simulated
+    unsigned long long* way_masks; //ways each trace may fill, NULL for all
+    metrics_t* trace_metrics;
+    long long* evicted_by_others; //lines of a trace evicted by another
+
+    char* journal_path; //binary event journal, NULL for none
+    long long keyframe_every; //records between keyframes of the journal
+    struct journal* journal; //open while simulate() runs
+    int rank_bits; //bits of the LRU rank of a compact line
+    int line_bits; //bits of a compact line, t + 2 + rank_bits
+
+    metrics_t metrics;
+
+    unsigned long long counter; // use for LRU
+    filter_t filter;
+} param_t; 
+
+typedef int (*access_fn)(cache_t*, param_t*, memaddr_t, metrics_t*);
+
+//event journal being written, see journalAccess(). The simulation fills
+//one buffer while a writer thread writes the other.
+typedef struct journal
+{
+    FILE* fp;
+    journal_event_t* buffers[2];
+    int current; //buffer being filled
+    size_t count; //events in it
+    journal_event_t* pending; //buffer handed to the writer, NULL if none
+    size_t pending_count;
+    int done; //no more buffers will come
+    int error;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t offset; //file offset of the next event
+    journal_keyframe_t* keyframes;
+    size_t num_keyframes;
+    size_t keyframes_size;
+    unsigned long long next_keyframe; //counter the next keyframe is due at
+    access_fn load; //what journalAccess wraps
+    access_fn update;
+    cache_line_t* before; //E lines, the set before the access
+} journal_t;
+
+//a cache level besides the L1 data cache, the I-cache or the L2. It is
+//simulated by loadCache/updateCache with params of its own.
+typedef struct level
+{
+    param_t params;
+    cache_t cache;
+} level_t;
+
 int verbose = 0; 
 
+//self-profiling, only built with -DCSIM_PROFILE (make csim-profile). The
+//phases and the cost of every access are measured with the time stamp
+//counter, the set walk counts the lines findLine() compares.
+#ifdef CSIM_PROFILE
+
+#define PHASE_OPEN 0 //opening and seeking the trace
+#define PHASE_PARSE 1 //reading records
+#define PHASE_SIMULATE 2 //simulateRecord()
+#define PHASE_REPORT 3 //printing the results
+#define NUM_PHASES 4
+#define PROFILE_BUCKETS 40 //access cost buckets, [2^k, 2^(k+1)) cycles
+#define PROFILE_MAX_WALK 64 //longer walks are counted in the last bucket
+
+typedef struct
+{
+    unsigned long long phase_cycles[NUM_PHASES];
+    unsigned long long access_cycles[PROFILE_BUCKETS];
+    unsigned long long set_walk[PROFILE_MAX_WALK + 1];
+} profile_t;
+
+const char* phase_names[NUM_PHASES] = {"open", "parse", "simulate", "report"};
+
+//every thread counts into its own profile, see profileMerge()
+__thread profile_t profile;
+profile_t profile_total;
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long long profile_start_cycles; //when main() started
+
+unsigned long long
+readCycles()
+{
+    return __builtin_ia32_rdtsc();
+}
+
+//profileAccess - one simulated record took the cycles since start
+void
+profileAccess(
+    unsigned long long start
+) {
+    unsigned long long cycles = readCycles() - start;
+    int bucket = 0;
+
+    profile.phase_cycles[PHASE_SIMULATE] += cycles;
+    while (cycles > 1 && bucket < PROFILE_BUCKETS - 1) {
+        cycles >>= 1;
+        bucket++;
+    }
+    profile.access_cycles[bucket]++;
+}
+
+//profileMerge - adds the calling thread's profile to the total
+void
+profileMerge()
+{
+    pthread_mutex_lock(&profile_lock);
+    for (int i = 0; i < NUM_PHASES; i++) {
+        profile_total.phase_cycles[i] += profile.phase_cycles[i];
+    }
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        profile_total.access_cycles[i] += profile.access_cycles[i];
+    }
+    for (int i = 0; i <= PROFILE_MAX_WALK; i++) {
+        profile_total.set_walk[i] += profile.set_walk[i];
+    }
+    memset(&profile, 0, sizeof(profile));
+    pthread_mutex_unlock(&profile_lock);
+}
+
+#define PROFILE_START(var) unsigned long long var = readCycles()
+#define PROFILE_PHASE(phase, start) (profile.phase_cycles[phase] += readCycles() - (start))
+#define PROFILE_ACCESS(start) profileAccess(start)
+#define PROFILE_WALK(lines) \
+    (profile.set_walk[(lines) < PROFILE_MAX_WALK ? (lines) : PROFILE_MAX_WALK]++)
+#define PROFILE_MERGE() profileMerge()
+#define PROFILE_INIT() (profile_start_cycles = readCycles())
+
+#else
+
+#define PROFILE_START(var)
+#define PROFILE_PHASE(phase, start)
+#define PROFILE_ACCESS(start)
+#define PROFILE_WALK(lines)
+#define PROFILE_MERGE()
+#define PROFILE_INIT()
+
+#endif
+
+#ifndef CSIM_LIBRARY
 //usage 
 void
 printUsage()
@@ -76,64 +599,188 @@ printUsage()
     printf("-E: lines per set\n");
     printf("-b: block offset bits\n");
     printf("-t: trace file name\n");
+    printf("--compact: bit-packed line metadata for very large caches\n");
+    printf("--lazy: set up cache sets on first access\n");
+    printf("--batch <manifest>: run every 'trace s E b' line of manifest\n");
+    printf("--threads <n>: worker threads for --batch (default: all cores)\n");
+    printf("--result-cache <dir>: reuse results of earlier identical runs\n");
+    printf("                      (default: $%s)\n", RESULT_CACHE_ENV);
+    printf("--checkpoint <file>: save a snapshot of the simulator at the end\n");
+    printf("--checkpoint-every <n>: also save it every n trace records\n");
+    printf("--resume <file>: continue a run from its snapshot\n");
+    printf("--warm <file>: start with the cache of a snapshot, count from zero\n");
+    printf("--count <n>: stop after n trace records\n");
+    printf("--sample-sets <k>: simulate a hashed 1/k of the sets and extrapolate\n");
+    printf("--sample-intervals <u>:<w>:<p>: every p records simulate a window of\n");
+    printf("                     u records after w uncounted warm-up records\n");
+    printf("                     (w can be 'all' for continuous warm-up)\n");
+    printf("--confidence <c>: confidence level of sampling intervals (default 0.95)\n");
+    printf("--prefetch <next-line|stride|stream|ampm>: hardware prefetcher\n");
+    printf("--prefetch-degree <n>: prefetches per trigger, stream depth (default 2)\n");
+    printf("--prefetch-latency <n>: accesses until a prefetch completes (default 10)\n");
+    printf("--stream-buffers <n>: number of stream buffers (default 4)\n");
+    printf("--write-through: stores are written to memory, lines stay clean\n");
+    printf("--no-write-allocate: store misses do not fill a line\n");
+    printf("--write-buffer <n>: coalescing write buffer of n blocks\n");
+    printf("--victim-cache <n>: fully associative victim cache of n lines\n");
+    printf("--hit-latency <c>: cycles of a cache hit (default 1)\n");
+    printf("--miss-penalty <c>: cycles a miss adds once it has the bus (default 100)\n");
+    printf("--bandwidth <n>: memory bus bytes per cycle (default unlimited)\n");
+    printf("--mshrs <n>: outstanding misses, 0 blocks on every miss (default 0)\n");
+    printf("--victim-latency <c>: cycles a victim cache hit adds (default 1)\n");
+    printf("--tlb <e>:<w>[:<e2>:<w2>]: L1 (and L2) TLB entries and ways (default 64:4:1536:12)\n");
+    printf("--page-size <4K|2M|1G>: page size of the TLB model (default 4K)\n");
+    printf("--walk-latency <c>: cycles per page table access of a walk (default 20)\n");
+    printf("--tlb-l2-latency <c>: cycles of an L2 TLB hit (default 7)\n");
+    printf("--pwc <n>: page walk cache entries (default 0, none)\n");
+    printf("--split-accesses: records crossing blocks access every block they touch\n");
+    printf("--sectors <n>: sectors per line, each with its own valid and dirty bit\n");
+    printf("--index <modulo|xor|prime|skew>: set index function (default modulo)\n");
+    printf("--sets <n>: number of sets, need not be a power of two (default 2^s)\n");
+    printf("--icache <s>:<E>:<b>: split L1, 'I' records go to an I-cache of this geometry\n");
+    printf("--l2 <s>:<E>:<b>: unified L2 behind the L1 cache(s)\n");
+    printf("--l2-latency <c>: cycles an L1 miss served by the L2 adds (default 10)\n");
+    printf("--traces <t1>,<t2>,...: traces sharing the cache, replayed instead of -t\n");
+    printf("--quantum <n>: records a trace runs before the next one's turn (default 1000)\n");
+    printf("--cat <m1>,<m2>,...: mask of the ways each trace may fill\n");
+    printf("--journal <file>: write line changes to a binary journal, see csim-journal\n");
+    printf("--keyframe-every <n>: records between journal keyframes (default 100000)\n");
+    printf("--trace-index: print the per-block summary of the trace index and exit\n");
+    printf("--trace-index-every <k>: records per block of the trace index <trace>.idx\n");
+    printf("                     (default 65536)\n");
+    printf("--range <start>:[<end>]: count only records start to end-1 (0 based)\n");
+    printf("--range-warmup <n>: records simulated uncounted before the range\n");
+    printf("--ranges <n>: simulate n ranges of the trace in parallel on --threads\n");
+    printf("--report <file>: also write the results to file, CSV if it ends in .csv,\n");
+    printf("                 JSON otherwise\n");
+}
+#endif
+
+//allocArena - maps size bytes of zeroed memory aligned to ARENA_ALIGN so
+//the kernel can back it with huge pages. Pages are only committed when
+//first written, which is what makes lazy sets cheap.
+void*
+allocArena(
+    size_t size,
+    size_t* mapped
+) {
+    char* base;
+    size_t head;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    base = mmap(NULL, size + ARENA_ALIGN, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    //trim the mapping down to an aligned window of size bytes
+    head = (ARENA_ALIGN - ((size_t) base & (ARENA_ALIGN - 1))) & (ARENA_ALIGN - 1);
+    if (head) {
+        munmap(base, head);
+    }
+    munmap(base + head + size, ARENA_ALIGN - head);
+    base += head;
+#ifdef MADV_HUGEPAGE
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+    *mapped = size;
+    return base;
+}
+
+//materializeSet - points a set at its lines and marks them empty
+void
+materializeSet(
+    cache_t* cache,
+    param_t* params,
+    long long index
+) {
+    cache_set_t* set = &cache->sets[index];
+    set->lines = &cache->lines[index * params->E];
+    set->last_accessed = NULL;
+    for (int j = 0; j < params->E; j++)
+    {
+        cache_line_t* line = &set->lines[j];
+        line->access = 0; 
+        line->validbit = 0; 
+        line->dirtybit = 0; 
+        line->tag = -1;
+    }
+    cache->materialized++;
 }
 
+//init - lines come first in the arena so they start on a huge page
+//boundary, the set headers follow them. In lazy mode sets stay NULL
+//until getCacheSet() first needs them.
 int
 init(
-    long long num_sets,
-    int num_lines,
+    param_t* params,
     cache_t* cache
 ) {
-    int result = 0;
-    int i=0; //set index
- 
-    cache->sets = (cache_set_t *) malloc(sizeof(cache_set_t) * num_sets); 
+    long long num_sets = params->S;
+    size_t lines_size = sizeof(cache_line_t) * num_sets * params->E;
+    long long i=0; //set index
+
+    //keep the set headers cache line aligned
+    lines_size = (lines_size + 63) & ~(size_t) 63;
+    cache->arena = allocArena(lines_size + sizeof(cache_set_t) * num_sets,
+                              &cache->arena_size);
+    if (cache->arena == NULL) {
+        return 1;
+    }
+    cache->lines = (cache_line_t *) cache->arena;
+    cache->sets = (cache_set_t *) ((char *) cache->arena + lines_size);
 
+    if (params->lazy) {
+        return 0;
+    }
     for (; i < num_sets; i++)
     {
-        int j=0; //line index 
-        cache->sets[i].lines =  
-                (cache_line_t *) malloc(sizeof(cache_line_t) * num_lines);
-        cache->sets[i].last_accessed = NULL;
-
-        for (; j < num_lines; j++)
-        {
-            cache_line_t* line = &cache->sets[i].lines[j];
-            line->access = 0; 
-            line->validbit = 0; 
-            line->tag = -1;
-        }
+        materializeSet(cache, params, i);
     }
 
-    return result; 
+    return 0; 
+}
+
+//initCompact - the packed lines start out zeroed, i.e. invalid. Ranks
+//are only kept for valid lines, so nothing else needs to be set up and
+//untouched parts of a huge cache are never written.
+int
+initCompact(
+    param_t* params,
+    cache_t* cache
+) {
+    unsigned long long num_bits;
+    int r = 0;
+
+    while ((1LL << r) < params->E) {
+        r++;
+    }
+    params->filter.slot = -1;
+    params->rank_bits = r;
+    params->line_bits = params->t + 2 + r;
+    num_bits = (unsigned long long) params->S * params->E * params->line_bits;
+    //one spare word, a field may straddle the end of the last one
+    cache->arena = allocArena((num_bits / 64 + 2) * sizeof(unsigned long long),
+                              &cache->arena_size);
+    if (cache->arena == NULL) {
+        return 1;
+    }
+    cache->packed = (unsigned long long *) cache->arena;
+    return 0;
 }
 
+//free_cache - sets and lines live in the arena, one unmap releases them
 void 
 free_cache(
-    cache_t* cache, 
-    long long num_sets,
-    int num_lines
+    cache_t* cache
 ) {
-    if (cache != NULL)
+    if (cache != NULL && cache->arena != NULL)
     {
-        if (cache->sets != NULL)
-        {
-            int i = 0; //set index
-            for (; i < num_sets; i++)
-            {
-                cache_set_t* set = &cache->sets[i];
-                if (set != NULL)
-                {
-                   if (set->lines != NULL) 
-                   {
-                       free(set->lines);
-                   }
-                   free(set);
-                }
-            }
-            free(cache->sets);
-        }
-        free(cache);
+        munmap(cache->arena, cache->arena_size);
+        cache->arena = NULL;
+        cache->sets = NULL;
+        cache->lines = NULL;
+        cache->packed = NULL;
     }
 }
 
@@ -152,7 +799,8 @@ getCacheSetIndex(
     int s,
     int b
 ) {
-    return (value << (MEMADDR_BITSIZE - s - b)) >> (MEMADDR_BITSIZE - s);
+    //a shift by MEMADDR_BITSIZE is undefined, mask instead so s=0 works
+    return (value >> b) & ((1ULL << s) - 1);
 }
 
 cache_set_t*
@@ -163,6 +811,9 @@ getCacheSet(
 ){
     memaddr_t index = getCacheSetIndex(memaddr,params->s,params->b);
     //printf("cache line: %llu\n",index);
+    if (cache->sets[index].lines == NULL) {
+        materializeSet(cache, params, index);
+    }
     return &cache->sets[index];
 }
 
@@ -183,6 +834,9 @@ isDirty(
     for (; i < params->S; i++)
     {
         cache_set_t* set = &cache->sets[i];
+        if (set->lines == NULL) { //never touched in lazy mode
+            continue;
+        }
         for (int j = 0; j < params->E;j++)
         {
             cache_line_t* cache_line = &set->lines[j];
@@ -194,6 +848,31 @@ isDirty(
     return 0;
 }
 
+//findLine - returns the valid line of the set holding tag, or NULL.
+//The MRU line is checked before walking the set, so repeated
+//references to one line of a set do not pay for the walk.
+cache_line_t*
+findLine(
+    cache_set_t* set,
+    memaddr_t tag,
+    param_t* params
+) {
+    cache_line_t* mru = set->last_accessed;
+    if (mru != NULL && mru->validbit && mru->tag == tag) {
+        PROFILE_WALK(0);
+        return mru;
+    }
+    for (int i = 0; i < params->E; i++) {
+        cache_line_t* cache_line = &set->lines[i];
+        if (cache_line->validbit && cache_line->tag == tag) {
+            PROFILE_WALK(i + 1);
+            return cache_line;
+        }
+    }
+    PROFILE_WALK(params->E);
+    return NULL;
+}
+
 void
 addMetrics(
      metrics_t* total,
@@ -220,22 +899,18 @@ loadCache(
     cache_set_t* set = getCacheSet(memaddr, params, cache);
     //printf("Tag value: %llu\n",tag);
     //check for hit
-    //locate a cache line with matching tag
-    for (int i = 0; i < params->E; i++) {
-        //go to index, see if tag bit is there 
-        cache_line_t* cache_line = &set->lines[i];
-        if (cache_line->validbit && cache_line->tag == tag) {
-           // found 
-           metrics->hitcount++;
-           //printf("Hit\n");
-           cache_line->access = params->counter;
-           if (set->last_accessed == cache_line) {
-              metrics->double_accesses++;
-              //printf("double-ref\n");
-           }
-           setLastAccessed(set, cache_line);
-           return 0;
-         }
+    //locate a cache line with matching tag, the MRU line first
+    match = findLine(set, tag, params);
+    if (match) {
+       metrics->hitcount++;
+       //printf("Hit\n");
+       match->access = params->counter;
+       if (set->last_accessed == match) {
+          metrics->double_accesses++;
+          //printf("double-ref\n");
+       }
+       setLastAccessed(set, match);
+       return 0;
     }
     //it is a miss
     metrics->misscount++; 
@@ -304,14 +979,7 @@ updateCache(
 
     // If tag matches and validbit is set, nothing to do
     // Its a hit
-    for (int i = 0; i < params->E; i++) {
-        cache_line_t* cache_line = &set->lines[i];
-        if (cache_line->tag == tag && cache_line->validbit)
-        {
-           match = cache_line;
-           break;
-        }
-    }
+    match = findLine(set, tag, params);
     if (match) {
        metrics->hitcount++;
        //printf("hit\n");
@@ -382,148 +1050,4246 @@ updateCache(
     return result;
 }
 
-void
-printMetrics(
-     char action,
-     memaddr_t memaddr,
-     int size,
-     metrics_t* metrics
+//getBits - reads a field of width bits (at most 64) starting at bit pos
+unsigned long long
+getBits(
+    unsigned long long* bits,
+    unsigned long long pos,
+    int width
 ) {
-     printf("%c %llx,%d ", action, memaddr, size);
-     if (metrics->misscount) {
-        printf(" Miss ");
-     }
-     if (metrics->hitcount) {
-        printf(" Hit ");
-     }
-     if (metrics->double_accesses) {
-        printf(" Double-Ref ");
-     }
-     if (metrics->dirty_evicted){
-        printf(" Dirty-Evicted ");
-     } else if (metrics->evictcount) {
-        printf(" Eviction ");
-     }
-     printf("\n");      
+    unsigned long long word = pos >> 6;
+    int shift = pos & 63;
+    unsigned long long value;
+
+    if (width == 0) {
+        return 0;
+    }
+    value = bits[word] >> shift;
+    if (shift + width > 64) {
+        value |= bits[word + 1] << (64 - shift);
+    }
+    if (width < 64) {
+        value &= (1ULL << width) - 1;
+    }
+    return value;
 }
 
+//setBits - writes a field of width bits (at most 64) starting at bit pos
 void
-printCacheSets(
-    FILE* fp,
-    char action,
-    int  serial,
-    memaddr_t memaddr,
-    cache_t* cache,
-    param_t* params
+setBits(
+    unsigned long long* bits,
+    unsigned long long pos,
+    int width,
+    unsigned long long value
 ) {
-    fprintf(fp, "%d %c %llx (tag: %llu, s: %llu)\n",
-        serial,
-        action,
-        memaddr,
-        getTag(memaddr, params->s, params->b),
-        getCacheSetIndex(memaddr, params->s, params->b));
-    fprintf(fp, "\tSet\t|#\t|T\t|V\t|D\t|lru\n");
-    for (int i = 0; i < params->S; i++) {
-        cache_set_t* set = &cache->sets[i];
-        fprintf(fp, "\t======\n");
-        for (int j = 0; j < params->E; j++) {
-            cache_line_t* cache_line = &set->lines[j];
-            fprintf(fp, "\t----------\n");
-			fprintf(fp, "\t%d\t|%d\t|%llu\t|%d\t|%d\t|%llu\n", i, j, cache_line->tag, cache_line->validbit, cache_line->dirtybit, cache_line->access);
-        }
+    unsigned long long word = pos >> 6;
+    int shift = pos & 63;
+    unsigned long long mask = (width < 64) ? (1ULL << width) - 1 : ~0ULL;
+
+    if (width == 0) {
+        return;
+    }
+    value &= mask;
+    bits[word] = (bits[word] & ~(mask << shift)) | (value << shift);
+    if (shift + width > 64) {
+        int low = 64 - shift;
+        bits[word + 1] = (bits[word + 1] & ~(mask >> low)) | (value >> low);
     }
 }
 
-int
-parseTraceFile(
-    char* file_path,
+//helpers for the fields of compact line slot (set * E + way)
+memaddr_t
+getCompactTag(
+    cache_t* cache,
     param_t* params,
-    cache_t* cache
+    long long slot
 ) {
-    int result = 0;
-    FILE *tmp = NULL; //trace file 
-    // FILE *fp = NULL; // Used for debugging
-    char action;
-    memaddr_t memaddr;
-    int size;
+    return getBits(cache->packed, slot * params->line_bits, params->t);
+}
 
-    // fp = fopen(DEBUG_FILE_PATH, "w");
-    // if (fp == NULL) {
-    //    printf("Error: failed to open debug file - %s\n", DEBUG_FILE_PATH);
-    //    return ERROR_OPEN_FILE;
-    // }
-    
-    tmp = fopen(file_path, "r"); 
-    if (tmp == NULL) {
+unsigned long long
+getCompactMeta(
+    cache_t* cache,
+    param_t* params,
+    long long slot
+) {
+    return getBits(cache->packed, slot * params->line_bits + params->t,
+                   2 + params->rank_bits);
+}
+
+void
+setCompactLine(
+    cache_t* cache,
+    param_t* params,
+    long long slot,
+    memaddr_t tag,
+    unsigned long long meta
+) {
+    setBits(cache->packed, slot * params->line_bits, params->t, tag);
+    setBits(cache->packed, slot * params->line_bits + params->t,
+            2 + params->rank_bits, meta);
+}
+
+void
+setCompactMeta(
+    cache_t* cache,
+    param_t* params,
+    long long slot,
+    unsigned long long meta
+) {
+    setBits(cache->packed, slot * params->line_bits + params->t,
+            2 + params->rank_bits, meta);
+}
+
+//promoteCompact - makes way the MRU line of the set. Every valid line
+//ranked below rank (more recent) moves down by one. A line being filled
+//passes rank E, so all valid lines move down.
+void
+promoteCompact(
+    cache_t* cache,
+    param_t* params,
+    long long first,
+    int way,
+    unsigned long long rank
+) {
+    for (int i = 0; i < params->E; i++) {
+        unsigned long long meta = getCompactMeta(cache, params, first + i);
+        if (i != way && (meta & COMPACT_VALID)
+                && (meta >> COMPACT_RANK_SHIFT) < rank) {
+            setCompactMeta(cache, params, first + i,
+                           meta + (1ULL << COMPACT_RANK_SHIFT));
+        }
+    }
+    setCompactMeta(cache, params, first + way,
+        getCompactMeta(cache, params, first + way)
+            & (COMPACT_VALID | COMPACT_DIRTY));
+}
+
+//accessCompact - loadCache/updateCache for compact mode. The MRU line of
+//a set is the one with rank 0, so double-refs need no last_accessed.
+int
+accessCompact(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics,
+    int store
+) {
+    memaddr_t tag = getTag(memaddr, params->s, params->b);
+    long long first = (long long) getCacheSetIndex(memaddr, params->s, params->b)
+                      * params->E;
+    int victim = -1;
+    int empty = -1;
+
+    for (int i = 0; i < params->E; i++) {
+        unsigned long long meta = getCompactMeta(cache, params, first + i);
+        if (!(meta & COMPACT_VALID)) {
+            if (empty < 0) {
+                empty = i;
+            }
+            continue;
+        }
+        if (getCompactTag(cache, params, first + i) == tag) {
+            metrics->hitcount++;
+            if ((meta >> COMPACT_RANK_SHIFT) == 0) {
+                metrics->double_accesses++;
+            }
+            if (store && !(meta & COMPACT_DIRTY)) {
+                setCompactMeta(cache, params, first + i, meta | COMPACT_DIRTY);
+                metrics->dirty_active += (1 << params->b);
+            }
+            promoteCompact(cache, params, first, i, meta >> COMPACT_RANK_SHIFT);
+            params->filter.slot = first + i;
+            return 0;
+        }
+        if ((meta >> COMPACT_RANK_SHIFT) == (unsigned long long) params->E - 1) {
+            victim = i;
+        }
+    }
+    metrics->misscount++;
+    if (empty >= 0) {
+        setCompactLine(cache, params, first + empty, tag,
+                       COMPACT_VALID | (store ? COMPACT_DIRTY : 0));
+        if (store) {
+            metrics->dirty_active += (1 << params->b);
+        }
+        promoteCompact(cache, params, first, empty, params->E);
+        params->filter.slot = first + empty;
+        return 0;
+    }
+    if (victim < 0) {
+        printf("Error: no cache_line found\n");
+        return ERROR_CACHE_LINE_NOT_FOUND;
+    }
+    metrics->evictcount++;
+    if (getCompactMeta(cache, params, first + victim) & COMPACT_DIRTY) {
+        metrics->dirty_evicted += (1 << params->b);
+        if (!store) {
+            metrics->dirty_active -= (1 << params->b);
+        }
+    } else if (store) {
+        metrics->dirty_active += (1 << params->b);
+    }
+    setCompactLine(cache, params, first + victim, tag,
+                   COMPACT_VALID | (store ? COMPACT_DIRTY : 0)
+                   | ((unsigned long long) (params->E - 1) << COMPACT_RANK_SHIFT));
+    promoteCompact(cache, params, first, victim, params->E - 1);
+    params->filter.slot = first + victim;
+    return 0;
+}
+
+int
+loadCompact(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return accessCompact(cache, params, memaddr, metrics, 0);
+}
+
+int
+updateCompact(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return accessCompact(cache, params, memaddr, metrics, 1);
+}
+
+//flushFilter - adds the hits of the current run to the totals and gives
+//its line the LRU stamp of the latest reference in the run. Must be
+//called before anything else looks at the cache.
+void
+flushFilter(
+    param_t* params
+) {
+    filter_t* filter = &params->filter;
+    if (filter->hits) {
+        params->metrics.hitcount += filter->hits;
+        params->metrics.double_accesses += filter->hits;
+        //a compact line keeps rank 0, there is no stamp to update
+        if (filter->line != NULL) {
+            filter->line->access = filter->access;
+        }
+        filter->hits = 0;
+    }
+}
+
+//startFilterRun - memaddr was just simulated, so its line is now the MRU
+//line of its set and later references to the same block can be filtered
+void
+startFilterRun(
+    param_t* params,
+    cache_t* cache,
+    memaddr_t memaddr
+) {
+    params->filter.block = memaddr >> params->b;
+    if (params->hashed) {
+        //getCacheSet() would pick the set from the address bits
+        params->filter.line = NULL;
+        return;
+    }
+    if (params->compact) {
+        //filter.slot was set by accessCompact
+        params->filter.line = NULL;
+        return;
+    }
+    params->filter.line = getCacheSet(memaddr, params, cache)->last_accessed;
+}
+
+//filterAccess - handles an access to the block of the current run without
+//walking the set. Every such access is a double-ref hit. Returns the
+//number of hits, 0 if the access is not part of the run. metrics gets
+//everything the access did, the totals only get its hits on flushFilter.
+int
+filterAccess(
+    cache_t* cache,
+    param_t* params,
+    char action,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    filter_t* filter = &params->filter;
+    int hits = (action == 'M') ? 2 : 1;
+
+    if ((params->compact ? filter->slot < 0 : filter->line == NULL)
+            || (memaddr >> params->b) != filter->block
+            || (action != 'L' && params->writes.write_through)
+            || params->sectors || params->hashed || params->journal != NULL) {
+        return 0;
+    }
+    if (action != 'L') {
+        int dirtied = 0;
+        if (filter->line != NULL && !filter->line->dirtybit) {
+            filter->line->dirtybit = 1;
+            dirtied = 1;
+        } else if (filter->line == NULL) {
+            unsigned long long meta = getCompactMeta(cache, params, filter->slot);
+            if (!(meta & COMPACT_DIRTY)) {
+                setCompactMeta(cache, params, filter->slot, meta | COMPACT_DIRTY);
+                dirtied = 1;
+            }
+        }
+        if (dirtied) {
+            params->metrics.dirty_active += (1 << params->b);
+            metrics->dirty_active += (1 << params->b);
+        }
+    }
+    filter->hits += hits;
+    filter->access = params->counter;
+    metrics->hitcount += hits;
+    metrics->double_accesses += hits;
+    return hits;
+}
+
+//findVictim - first invalid line of the set, else the least recently used
+cache_line_t*
+findVictim(
+    cache_set_t* set,
+    param_t* params
+) {
+    cache_line_t* victim = NULL;
+    for (int i = 0; i < params->E; i++) {
+        cache_line_t* cache_line = &set->lines[i];
+        if (!cache_line->validbit) {
+            return cache_line;
+        }
+        if (victim == NULL || cache_line->access < victim->access) {
+            victim = cache_line;
+        }
+    }
+    return victim;
+}
+
+//initWritePolicy - write buffer and victim cache, both start out empty
+int
+initWritePolicy(
+    param_t* params
+) {
+    write_policy_t* wp = &params->writes;
+    size_t mask_size = (params->B + 7) / 8;
+
+    if (wp->buffer_entries) {
+        wp->buffer = calloc(wp->buffer_entries, sizeof(write_entry_t));
+        if (wp->buffer == NULL) {
+            return ERROR_INIT_CACHE;
+        }
+        for (int i = 0; i < wp->buffer_entries; i++) {
+            wp->buffer[i].mask = calloc(mask_size, 1);
+            if (wp->buffer[i].mask == NULL) {
+                return ERROR_INIT_CACHE;
+            }
+        }
+    }
+    if (wp->victim_lines) {
+        wp->victims = calloc(wp->victim_lines, sizeof(victim_line_t));
+        if (wp->victims == NULL) {
+            return ERROR_INIT_CACHE;
+        }
+    }
+    return 0;
+}
+
+void
+freeWritePolicy(
+    write_policy_t* wp
+) {
+    for (int i = 0; wp->buffer != NULL && i < wp->buffer_entries; i++) {
+        free(wp->buffer[i].mask);
+    }
+    free(wp->buffer);
+    free(wp->victims);
+    wp->buffer = NULL;
+    wp->victims = NULL;
+}
+
+//drainWriteBuffer - writes the oldest buffered block to memory
+void
+drainWriteBuffer(
+    param_t* params
+) {
+    write_policy_t* wp = &params->writes;
+    write_entry_t* entry = &wp->buffer[wp->buffer_head];
+
+    wp->memory_bytes += entry->bytes;
+    wp->memory_writes++;
+    memset(entry->mask, 0, (params->B + 7) / 8);
+    entry->bytes = 0;
+    wp->buffer_head = (wp->buffer_head + 1) % wp->buffer_entries;
+    wp->buffer_count--;
+}
+
+//memoryWrite - size bytes at memaddr leave the cache. With a write buffer
+//they are merged into the entry of their block if there is one, else a
+//new entry is made, draining the oldest one when the buffer is full.
+void
+memoryWrite(
+    param_t* params,
+    memaddr_t memaddr,
+    int size
+) {
+    write_policy_t* wp = &params->writes;
+    memaddr_t block = memaddr >> params->b;
+    int offset = memaddr & (params->B - 1);
+    write_entry_t* entry = NULL;
+
+    if (size > params->B - offset) {
+        size = params->B - offset; //the rest belongs to the next block
+    }
+    if (wp->buffer_entries == 0) {
+        wp->memory_bytes += size;
+        wp->memory_writes++;
+        return;
+    }
+    for (int i = 0; i < wp->buffer_count; i++) {
+        write_entry_t* buffered = &wp->buffer[(wp->buffer_head + i) % wp->buffer_entries];
+        if (buffered->block == block) {
+            entry = buffered;
+            wp->coalesced++;
+            break;
+        }
+    }
+    if (entry == NULL) {
+        if (wp->buffer_count == wp->buffer_entries) {
+            drainWriteBuffer(params);
+        }
+        entry = &wp->buffer[(wp->buffer_head + wp->buffer_count++) % wp->buffer_entries];
+        entry->block = block;
+    }
+    for (int i = offset; i < offset + size; i++) {
+        if (!(entry->mask[i / 8] & (1 << (i % 8)))) {
+            entry->mask[i / 8] |= 1 << (i % 8);
+            entry->bytes++;
+        }
+    }
+}
+
+//finishWrites - drains the write buffer at the end of the trace. Dirty
+//lines still cached are not written, they are in dirty_bytes_active.
+void
+finishWrites(
+    param_t* params
+) {
+    while (params->writes.buffer_count > 0) {
+        drainWriteBuffer(params);
+    }
+}
+
+//findVictimLine - way of the victim cache holding block, -1 if none does
+int
+findVictimLine(
+    param_t* params,
+    memaddr_t block
+) {
+    write_policy_t* wp = &params->writes;
+    for (int i = 0; i < wp->victim_lines; i++) {
+        if (wp->victims[i].validbit && wp->victims[i].block == block) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//retireLine - block was evicted from the cache. It moves to the victim
+//cache if there is one, pushing out its LRU line. Whatever leaves the
+//chip dirty is written back. A dirty line in the victim cache stays in
+//dirty_active, it has not been written yet.
+void
+retireLine(
+    param_t* params,
+    memaddr_t block,
+    int dirty,
+    metrics_t* metrics
+) {
+    write_policy_t* wp = &params->writes;
+
+    if (wp->victim_lines) {
+        victim_line_t* slot = &wp->victims[0];
+        for (int i = 1; i < wp->victim_lines && slot->validbit; i++) {
+            if (!wp->victims[i].validbit || wp->victims[i].access < slot->access) {
+                slot = &wp->victims[i];
+            }
+        }
+        victim_line_t pushed = *slot;
+        slot->block = block;
+        slot->validbit = 1;
+        slot->dirtybit = dirty;
+        slot->access = params->counter;
+        if (!pushed.validbit) {
+            return;
+        }
+        block = pushed.block;
+        dirty = pushed.dirtybit;
+    }
+    if (dirty) {
+        metrics->dirty_evicted += (1 << params->b);
+        metrics->dirty_active -= (1 << params->b);
+        memoryWrite(params, block << params->b, 1 << params->b);
+    }
+}
+
+//storeLine - a store to the cached line, written through or marked dirty
+void
+storeLine(
+    param_t* params,
+    cache_line_t* line,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    if (params->writes.write_through) {
+        memoryWrite(params, memaddr, params->access_size);
+    } else if (!line->dirtybit) {
+        line->dirtybit = 1;
+        metrics->dirty_active += (1 << params->b);
+    }
+}
+
+//policyAccess - loadCache/updateCache for the configurable write
+//policies. A miss looks in the victim cache before going to memory; a
+//block found there is swapped back with the line it replaces. A store
+//miss without write-allocate leaves the set alone, so no line of the set
+//is the last accessed one afterwards.
+int
+policyAccess(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics,
+    int store
+) {
+    write_policy_t* wp = &params->writes;
+    memaddr_t tag = getTag(memaddr, params->s, params->b);
+    cache_set_t* set = getCacheSet(memaddr, params, cache);
+    cache_line_t* match = findLine(set, tag, params);
+    int dirty = 0;
+    int way;
+
+    if (match) {
+        metrics->hitcount++;
+        if (set->last_accessed == match) {
+            metrics->double_accesses++;
+        }
+        match->access = params->counter;
+        setLastAccessed(set, match);
+        if (store) {
+            storeLine(params, match, memaddr, metrics);
+        }
+        return 0;
+    }
+    metrics->misscount++;
+    way = findVictimLine(params, memaddr >> params->b);
+    if (way >= 0) {
+        wp->victim_hits++;
+        dirty = wp->victims[way].dirtybit;
+        wp->victims[way].validbit = 0; //its slot takes the replaced line
+    } else if (store && wp->no_write_allocate) {
+        memoryWrite(params, memaddr, params->access_size);
+        setLastAccessed(set, NULL);
+        return 0;
+    }
+    match = findVictim(set, params);
+    if (match->validbit) {
+        metrics->evictcount++;
+        retireLine(params, (match->tag << params->s)
+                   | getCacheSetIndex(memaddr, params->s, params->b),
+                   match->dirtybit, metrics);
+    }
+    match->validbit = 1;
+    match->dirtybit = dirty;
+    match->tag = tag;
+    match->access = params->counter;
+    match->prefetched = 0;
+    setLastAccessed(set, match);
+    if (store) {
+        storeLine(params, match, memaddr, metrics);
+    }
+    return 0;
+}
+
+int
+loadPolicy(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return policyAccess(cache, params, memaddr, metrics, 0);
+}
+
+int
+updatePolicy(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return policyAccess(cache, params, memaddr, metrics, 1);
+}
+
+//sectorMask - bits of the sectors of its block the access at memaddr of
+//params->access_size bytes touches
+unsigned long long
+sectorMask(
+    param_t* params,
+    memaddr_t memaddr
+) {
+    int offset = memaddr & (params->B - 1);
+    int last = offset + (params->access_size > 0 ? params->access_size : 1) - 1;
+    int first_sector = offset >> params->sector_bits;
+    int last_sector;
+
+    if (last >= params->B) {
+        last = params->B - 1; //the rest is not in this block
+    }
+    last_sector = last >> params->sector_bits;
+    return (last_sector == 63 ? ~0ULL : (1ULL << (last_sector + 1)) - 1)
+           & ~((1ULL << first_sector) - 1);
+}
+
+//fullSectors - those of mask that the access overwrites completely
+unsigned long long
+fullSectors(
+    param_t* params,
+    memaddr_t memaddr,
+    unsigned long long mask
+) {
+    int sector_size = 1 << params->sector_bits;
+    int offset = memaddr & (params->B - 1);
+    int end = offset + params->access_size;
+
+    if (offset % sector_size != 0) {
+        mask &= ~(1ULL << (offset >> params->sector_bits));
+    }
+    if (end < params->B && end % sector_size != 0) {
+        mask &= ~(1ULL << (end >> params->sector_bits));
+    }
+    return mask;
+}
+
+//sectorAccess - loadCache/updateCache for a sectored cache. Lines are
+//allocated as usual but only the sectors accessed are fetched, and only
+//dirty sectors are written back, so the dirty byte metrics count
+//sectors. A store that overwrites whole sectors does not fetch them. An
+//access that needs to fetch a sector of a cached line is a miss.
+int
+sectorAccess(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics,
+    int store
+) {
+    int sector_size = 1 << params->sector_bits;
+    memaddr_t tag = getTag(memaddr, params->s, params->b);
+    cache_set_t* set = getCacheSet(memaddr, params, cache);
+    cache_line_t* line = findLine(set, tag, params);
+    unsigned long long needed = sectorMask(params, memaddr);
+    unsigned long long fetch;
+    unsigned long long dirtied;
+    int mru = (line != NULL && set->last_accessed == line);
+
+    if (line == NULL) {
+        line = findVictim(set, params);
+        if (line->validbit) {
+            int dirty_bytes = __builtin_popcountll(line->sector_dirty) * sector_size;
+            metrics->evictcount++;
+            metrics->dirty_evicted += dirty_bytes;
+            metrics->dirty_active -= dirty_bytes;
+        }
+        line->validbit = 1;
+        line->dirtybit = 0;
+        line->tag = tag;
+        line->sector_valid = 0;
+        line->sector_dirty = 0;
+        line->prefetched = 0;
+    }
+    fetch = needed & ~line->sector_valid;
+    if (store) {
+        fetch &= ~fullSectors(params, memaddr, needed);
+    }
+    if (fetch != 0 || line->sector_valid == 0) {
+        metrics->misscount++;
+        if (line->sector_valid != 0) {
+            params->sector_misses++;
+        }
+    } else {
+        metrics->hitcount++;
+        if (mru) {
+            metrics->double_accesses++;
+        }
+    }
+    params->fetched_bytes += __builtin_popcountll(fetch) * sector_size;
+    line->sector_valid |= needed;
+    if (store) {
+        dirtied = needed & ~line->sector_dirty;
+        line->sector_dirty |= needed;
+        line->dirtybit = 1;
+        metrics->dirty_active += __builtin_popcountll(dirtied) * sector_size;
+    }
+    line->access = params->counter;
+    setLastAccessed(set, line);
+    return 0;
+}
+
+int
+loadSectored(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return sectorAccess(cache, params, memaddr, metrics, 0);
+}
+
+int
+updateSectored(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return sectorAccess(cache, params, memaddr, metrics, 1);
+}
+
+const char* index_names[] = {"modulo", "xor", "prime", "skew"};
+
+//initIndex - constants of the index function, once S is known
+void
+initIndex(
+    param_t* params
+) {
+    params->index_bits = 0;
+    while ((1LL << params->index_bits) < params->S) {
+        params->index_bits++;
+    }
+    params->modulus = params->S;
+    for (; params->modulus > 2; params->modulus--) {
+        long long d = 2;
+        while (d * d <= params->modulus && params->modulus % d != 0) {
+            d++;
+        }
+        if (d * d > params->modulus) {
+            break;
+        }
+    }
+}
+
+//hashIndex - set of block under the index function. Skewed caches hash
+//with a different odd multiplier for every way.
+memaddr_t
+hashIndex(
+    param_t* params,
+    memaddr_t block,
+    int way
+) {
+    memaddr_t index = 0;
+    memaddr_t hash;
+
+    switch (params->index_kind) {
+    case INDEX_XOR:
+        if (params->index_bits == 0) {
+            return 0;
+        }
+        for (; block != 0; block >>= params->index_bits) {
+            index ^= block & ((1ULL << params->index_bits) - 1);
+        }
+        return index % params->S;
+    case INDEX_PRIME:
+        return block % params->modulus;
+    case INDEX_SKEW:
+        hash = block * (0x9e3779b97f4a7c15ULL * (2 * way + 1));
+        return (hash ^ (hash >> 32)) % params->S;
+    default:
+        return block % params->S;
+    }
+}
+
+//setAt - set index, set up first in lazy mode
+cache_set_t*
+setAt(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t index
+) {
+    if (cache->sets[index].lines == NULL) {
+        materializeSet(cache, params, index);
+    }
+    return &cache->sets[index];
+}
+
+//hashedAccess - loadCache/updateCache for the other index functions. The
+//tag is the whole block number, the set index cannot be taken out of the
+//address. A skewed cache looks at way w of set hashIndex(block, w) for
+//every w; such a line counts as part of that set for double-refs.
+int
+hashedAccess(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics,
+    int store
+) {
+    memaddr_t block = memaddr >> params->b;
+    // only the best candidate so far is kept, so E is not bounded by the stack
+    cache_line_t* match = NULL;
+    cache_line_t* victim = NULL;
+    cache_set_t* victim_set = NULL;
+    cache_set_t* set = NULL;
+
+    for (int w = 0; w < params->E; w++) {
+        if (params->index_kind == INDEX_SKEW || w == 0) {
+            set = setAt(cache, params, hashIndex(params, block, w));
+        }
+        cache_line_t* line = &set->lines[w];
+        if (line->validbit && line->tag == block) {
+            match = line;
+            victim_set = set;
+            break;
+        }
+        if (victim != NULL && !victim->validbit) {
+            continue;
+        }
+        if (victim == NULL || !line->validbit || line->access < victim->access) {
+            victim = line;
+            victim_set = set;
+        }
+    }
+    if (match) {
+        metrics->hitcount++;
+        if (victim_set->last_accessed == match) {
+            metrics->double_accesses++;
+        }
+    } else {
+        metrics->misscount++;
+        match = victim;
+        if (match->validbit) {
+            metrics->evictcount++;
+            if (match->dirtybit) {
+                metrics->dirty_evicted += (1 << params->b);
+                metrics->dirty_active -= (1 << params->b);
+            }
+        }
+        match->validbit = 1;
+        match->dirtybit = 0;
+        match->tag = block;
+    }
+    if (store && !match->dirtybit) {
+        match->dirtybit = 1;
+        metrics->dirty_active += (1 << params->b);
+    }
+    match->access = params->counter;
+    setLastAccessed(victim_set, match);
+    return 0;
+}
+
+int
+loadHashed(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return hashedAccess(cache, params, memaddr, metrics, 0);
+}
+
+int
+updateHashed(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return hashedAccess(cache, params, memaddr, metrics, 1);
+}
+
+//initLevel - sets up the I-cache or L2 of geometry, NULL on failure
+level_t*
+initLevel(
+    param_t* params,
+    geometry_t* geometry
+) {
+    level_t* level = calloc(1, sizeof(level_t));
+
+    if (level == NULL) {
+        return NULL;
+    }
+    level->params.s = geometry->s;
+    level->params.E = geometry->E;
+    level->params.b = geometry->b;
+    level->params.S = 1LL << geometry->s;
+    level->params.B = 1 << geometry->b;
+    level->params.t = 64 - geometry->s - geometry->b;
+    level->params.lazy = params->lazy;
+    if (init(&level->params, &level->cache) != 0) {
+        free(level);
+        return NULL;
+    }
+    return level;
+}
+
+//freeLevel - frees level, keeping its metrics in metrics
+void
+freeLevel(
+    level_t* level,
+    metrics_t* metrics
+) {
+    if (level != NULL) {
+        *metrics = level->params.metrics;
+        free_cache(&level->cache);
+        free(level);
+    }
+}
+
+//levelAccess - a load (or with store, a write-back) of memaddr in level.
+//Returns 1 on a hit.
+int
+levelAccess(
+    param_t* params,
+    level_t* level,
+    memaddr_t memaddr,
+    int store
+) {
+    metrics_t metrics = {0};
+
+    level->params.counter = params->counter;
+    if (store) {
+        updateCache(&level->cache, &level->params, memaddr, &metrics);
+    } else {
+        loadCache(&level->cache, &level->params, memaddr, &metrics);
+    }
+    addMetrics(&level->params.metrics, &metrics);
+    return metrics.hitcount != 0;
+}
+
+//fetchInstruction - an 'I' record in the I-cache, misses go to the L2
+void
+fetchInstruction(
+    param_t* params,
+    memaddr_t memaddr
+) {
+    if (!levelAccess(params, params->icache, memaddr, 0) && params->l2 != NULL) {
+        levelAccess(params, params->l2, memaddr, 0);
+    }
+}
+
+//hierarchyAccess - loadCache/updateCache of the L1 D-cache in front of
+//an L2. The line a miss replaces is the one loadCache/updateCache will
+//pick, the first invalid one or else the LRU one. A miss is fetched from
+//the L2, a dirty victim is written back to it. The L2 is neither
+//inclusive nor exclusive, L1 lines are not invalidated by L2 evictions.
+int
+hierarchyAccess(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics,
+    int store
+) {
+    cache_set_t* set = getCacheSet(memaddr, params, cache);
+    memaddr_t tag = getTag(memaddr, params->s, params->b);
+    int missed = findLine(set, tag, params) == NULL;
+    memaddr_t writeback = 0;
+    int dirty = 0;
+    int result;
+
+    if (missed) {
+        cache_line_t* victim = findVictim(set, params);
+        if (victim->validbit && victim->dirtybit) {
+            dirty = 1;
+            writeback = ((victim->tag << params->s)
+                         | getCacheSetIndex(memaddr, params->s, params->b))
+                        << params->b;
+        }
+    }
+    result = store ? updateCache(cache, params, memaddr, metrics)
+                   : loadCache(cache, params, memaddr, metrics);
+    if (missed) {
+        if (levelAccess(params, params->l2, memaddr, 0)) {
+            params->l2_fetch_hits++;
+        }
+        if (dirty) {
+            levelAccess(params, params->l2, writeback, 1);
+        }
+    }
+    return result;
+}
+
+int
+loadHierarchy(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return hierarchyAccess(cache, params, memaddr, metrics, 0);
+}
+
+int
+updateHierarchy(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return hierarchyAccess(cache, params, memaddr, metrics, 1);
+}
+
+//printLevel - metrics of the I-cache or L2, in printSummary's format
+void
+printLevel(
+    const char* name,
+    metrics_t* metrics
+) {
+    printf("%s: hits:%d misses:%d evictions:%d dirty_bytes_evicted:%d "
+           "dirty_bytes_active:%d double_refs:%d\n", name,
+           metrics->hitcount, metrics->misscount, metrics->evictcount,
+           metrics->dirty_evicted, metrics->dirty_active,
+           metrics->double_accesses);
+}
+
+//multiAccess - loadCache/updateCache when several traces share the
+//cache. A line only hits for the trace that brought it in. With way
+//masks (as with Intel CAT) a trace only fills ways of its mask, though
+//it hits wherever its lines are.
+int
+multiAccess(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics,
+    int store
+) {
+    memaddr_t tag = getTag(memaddr, params->s, params->b);
+    cache_set_t* set = getCacheSet(memaddr, params, cache);
+    unsigned long long* masks = params->way_masks;
+    cache_line_t* match = NULL;
+    cache_line_t* victim = NULL;
+
+    for (int i = 0; i < params->E; i++) {
+        cache_line_t* line = &set->lines[i];
+        if (line->validbit && line->tag == tag && line->asid == params->asid) {
+            match = line;
+            break;
+        }
+        //way masks only exist for E <= 64
+        if ((masks != NULL && !(masks[params->asid] & (1ULL << i)))
+                || (victim != NULL && !victim->validbit)) {
+            continue;
+        }
+        if (victim == NULL || !line->validbit || line->access < victim->access) {
+            victim = line;
+        }
+    }
+    if (match) {
+        metrics->hitcount++;
+        if (set->last_accessed == match) {
+            metrics->double_accesses++;
+        }
+    } else {
+        metrics->misscount++;
+        match = victim;
+        if (match->validbit) {
+            metrics->evictcount++;
+            if (match->dirtybit) {
+                metrics->dirty_evicted += (1 << params->b);
+                metrics->dirty_active -= (1 << params->b);
+            }
+            if (match->asid != params->asid) {
+                params->evicted_by_others[match->asid]++;
+                if (match->dirtybit) {
+                    //dirty bytes are the owner's, metrics goes to this trace
+                    metrics_t* owner = &params->trace_metrics[match->asid];
+                    metrics_t* self = &params->trace_metrics[params->asid];
+                    owner->dirty_evicted += (1 << params->b);
+                    owner->dirty_active -= (1 << params->b);
+                    self->dirty_evicted -= (1 << params->b);
+                    self->dirty_active += (1 << params->b);
+                }
+            }
+        }
+        match->validbit = 1;
+        match->dirtybit = 0;
+        match->tag = tag;
+        match->asid = params->asid;
+    }
+    if (store && !match->dirtybit) {
+        match->dirtybit = 1;
+        metrics->dirty_active += (1 << params->b);
+    }
+    match->access = params->counter;
+    setLastAccessed(set, match);
+    return 0;
+}
+
+int
+loadMulti(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return multiAccess(cache, params, memaddr, metrics, 0);
+}
+
+int
+updateMulti(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return multiAccess(cache, params, memaddr, metrics, 1);
+}
+
+const char* prefetch_names[] = {"none", "next-line", "stride", "stream", "ampm"};
+
+//initPrefetcher - tables of the selected prefetcher, all start empty
+int
+initPrefetcher(
+    prefetcher_t* pf
+) {
+    pf->pollution = calloc(POLLUTION_FILTER_SIZE, sizeof(memaddr_t));
+    switch (pf->kind) {
+    case PREFETCH_STRIDE:
+        pf->strides = calloc(STRIDE_TABLE_SIZE, sizeof(stride_entry_t));
+        break;
+    case PREFETCH_STREAM:
+        pf->buffers = calloc(pf->num_buffers, sizeof(stream_buffer_t));
+        for (int i = 0; pf->buffers != NULL && i < pf->num_buffers; i++) {
+            pf->buffers[i].ready = calloc(pf->degree, sizeof(unsigned long long));
+            if (pf->buffers[i].ready == NULL) {
+                return ERROR_INIT_CACHE;
+            }
+        }
+        break;
+    case PREFETCH_AMPM:
+        pf->zones = calloc(AMPM_ZONES, sizeof(ampm_zone_t));
+        break;
+    }
+    if (pf->pollution == NULL
+            || (pf->kind == PREFETCH_STRIDE && pf->strides == NULL)
+            || (pf->kind == PREFETCH_STREAM && pf->buffers == NULL)
+            || (pf->kind == PREFETCH_AMPM && pf->zones == NULL)) {
+        return ERROR_INIT_CACHE;
+    }
+    return 0;
+}
+
+void
+freePrefetcher(
+    prefetcher_t* pf
+) {
+    for (int i = 0; pf->buffers != NULL && i < pf->num_buffers; i++) {
+        free(pf->buffers[i].ready);
+    }
+    free(pf->buffers);
+    free(pf->strides);
+    free(pf->zones);
+    free(pf->pollution);
+    pf->buffers = NULL;
+    pf->strides = NULL;
+    pf->zones = NULL;
+    pf->pollution = NULL;
+}
+
+//prefetchBlock - fills block into the cache as a prefetch completing at
+//ready. The write-back of a dirty victim is counted in the prefetch stats
+//with the eviction, metrics (those of the access that triggered the
+//prefetch) only lose its dirty bytes. Returns the line, or NULL if the
+//block is already cached.
+cache_line_t*
+prefetchBlock(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t block,
+    metrics_t* metrics,
+    unsigned long long ready
+) {
+    prefetcher_t* pf = &params->prefetch;
+    memaddr_t memaddr = block << params->b;
+    memaddr_t tag = getTag(memaddr, params->s, params->b);
+    cache_set_t* set = getCacheSet(memaddr, params, cache);
+    cache_line_t* victim;
+
+    if (findLine(set, tag, params) != NULL || findVictimLine(params, block) >= 0) {
+        return NULL;
+    }
+    victim = findVictim(set, params);
+    if (victim->validbit) {
+        memaddr_t evicted = (victim->tag << params->s)
+                            | getCacheSetIndex(memaddr, params->s, params->b);
+        metrics_t retired = {0};
+        pf->stats.evictions++;
+        pf->pollution[evicted % POLLUTION_FILTER_SIZE] = evicted + 1;
+        retireLine(params, evicted, victim->dirtybit, &retired);
+        //the write-back belongs to the prefetch stats like the eviction,
+        //only the dirty state is the cache's
+        pf->stats.writeback_bytes += retired.dirty_evicted;
+        metrics->dirty_active += retired.dirty_active;
+    }
+    //the victim is gone, neither a double-ref nor the filter may find it
+    if (set->last_accessed == victim) {
+        set->last_accessed = NULL;
+    }
+    if (params->filter.line == victim) {
+        flushFilter(params);
+        params->filter.line = NULL;
+    }
+    victim->validbit = 1;
+    victim->dirtybit = 0;
+    victim->tag = tag;
+    victim->access = params->counter;
+    victim->prefetched = 1;
+    victim->ready = ready;
+    pf->stats.issued++;
+    return victim;
+}
+
+//streamBufferHit - a demand miss to block that is in a stream buffer
+//moves it into the cache. Entries in front of it are dropped and the
+//buffer is topped up again. Returns the line, NULL if no buffer has it.
+cache_line_t*
+streamBufferHit(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t block,
+    metrics_t* metrics
+) {
+    prefetcher_t* pf = &params->prefetch;
+
+    for (int i = 0; i < pf->num_buffers; i++) {
+        stream_buffer_t* buffer = &pf->buffers[i];
+        if (buffer->count == 0 || block < buffer->first
+                || block >= buffer->first + buffer->count) {
+            continue;
+        }
+        unsigned long long ready = buffer->ready[block % pf->degree];
+        buffer->count -= block + 1 - buffer->first;
+        buffer->first = block + 1;
+        buffer->access = params->counter;
+        while (buffer->count < pf->degree) {
+            memaddr_t next = buffer->first + buffer->count++;
+            buffer->ready[next % pf->degree] = params->counter + pf->latency;
+            pf->stats.issued++;
+        }
+        cache_line_t* line = prefetchBlock(cache, params, block, metrics, ready);
+        if (line != NULL) {
+            pf->stats.issued--; //counted when it went into the buffer
+        }
+        return line;
+    }
+    return NULL;
+}
+
+//allocateStreamBuffer - a demand miss outside of all buffers restarts the
+//least recently used buffer on the blocks following it
+void
+allocateStreamBuffer(
+    param_t* params,
+    memaddr_t block
+) {
+    prefetcher_t* pf = &params->prefetch;
+    stream_buffer_t* buffer = &pf->buffers[0];
+
+    for (int i = 1; i < pf->num_buffers; i++) {
+        if (pf->buffers[i].access < buffer->access) {
+            buffer = &pf->buffers[i];
+        }
+    }
+    buffer->first = block + 1;
+    buffer->count = pf->degree;
+    buffer->access = params->counter;
+    for (int k = 0; k < pf->degree; k++) {
+        buffer->ready[(block + 1 + k) % pf->degree] =
+            params->counter + pf->latency;
+    }
+    pf->stats.issued += pf->degree;
+}
+
+//trainStride - per region (PC-less) stride detection, prefetches degree
+//strides ahead once the same stride was seen twice in a row
+void
+trainStride(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    prefetcher_t* pf = &params->prefetch;
+    memaddr_t block = memaddr >> params->b;
+    memaddr_t region = memaddr >> STRIDE_REGION_BITS;
+    stride_entry_t* entry = &pf->strides[region % STRIDE_TABLE_SIZE];
+    long long stride;
+
+    if (!entry->valid || entry->region != region) {
+        entry->valid = 1;
+        entry->region = region;
+        entry->last_block = block;
+        entry->stride = 0;
+        entry->confidence = 0;
+        return;
+    }
+    stride = (long long) (block - entry->last_block);
+    if (stride == 0) {
+        return;
+    }
+    if (stride == entry->stride) {
+        if (entry->confidence < 3) {
+            entry->confidence++;
+        }
+    } else {
+        entry->stride = stride;
+        entry->confidence = 0;
+    }
+    entry->last_block = block;
+    if (entry->confidence >= 2) {
+        for (int k = 1; k <= pf->degree; k++) {
+            prefetchBlock(cache, params, block + k * stride, metrics,
+                          params->counter + pf->latency);
+        }
+    }
+}
+
+//trainAmpm - access map pattern matching. Every zone keeps a map of the
+//lines accessed or prefetched. If the lines k and 2k behind the access
+//were accessed, the line k ahead is prefetched (and the same backwards),
+//for each stride k up to AMPM_MAX_STRIDE until degree prefetches.
+void
+trainAmpm(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    prefetcher_t* pf = &params->prefetch;
+    memaddr_t block = memaddr >> params->b;
+    memaddr_t zone = block / AMPM_ZONE_LINES;
+    int index = block % AMPM_ZONE_LINES;
+    ampm_zone_t* map = NULL;
+    ampm_zone_t* lru = &pf->zones[0];
+    int issued = 0;
+
+    for (int i = 0; i < AMPM_ZONES; i++) {
+        if (pf->zones[i].valid && pf->zones[i].zone == zone) {
+            map = &pf->zones[i];
+            break;
+        }
+        if (pf->zones[i].access < lru->access) {
+            lru = &pf->zones[i];
+        }
+    }
+    if (map == NULL) {
+        map = lru;
+        memset(map, 0, sizeof(*map));
+        map->valid = 1;
+        map->zone = zone;
+    }
+    map->access = params->counter;
+    map->state[index] = AMPM_ACCESS;
+
+    for (int k = 1; k <= AMPM_MAX_STRIDE && issued < pf->degree; k++) {
+        int ahead = index + k;
+        int behind = index - k;
+        if (ahead < AMPM_ZONE_LINES && index - 2 * k >= 0
+                && map->state[ahead] == AMPM_INIT
+                && map->state[behind] == AMPM_ACCESS
+                && map->state[index - 2 * k] == AMPM_ACCESS) {
+            map->state[ahead] = AMPM_PREFETCH;
+            prefetchBlock(cache, params, block + k, metrics,
+                          params->counter + pf->latency);
+            issued++;
+        }
+        if (issued < pf->degree && behind >= 0 && index + 2 * k < AMPM_ZONE_LINES
+                && map->state[behind] == AMPM_INIT
+                && map->state[ahead] == AMPM_ACCESS
+                && map->state[index + 2 * k] == AMPM_ACCESS) {
+            map->state[behind] = AMPM_PREFETCH;
+            prefetchBlock(cache, params, block - k, metrics,
+                          params->counter + pf->latency);
+            issued++;
+        }
+    }
+}
+
+//prefetchAccess - loadCache/updateCache with a prefetcher. Accounts for
+//demand references to prefetched lines, then trains the prefetcher:
+//next-line and stream buffers on misses (next-line also on the first
+//use of a prefetched line), stride and AMPM on every access.
+int
+prefetchAccess(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics,
+    int store
+) {
+    prefetcher_t* pf = &params->prefetch;
+    memaddr_t block = memaddr >> params->b;
+    cache_set_t* set = getCacheSet(memaddr, params, cache);
+    cache_line_t* line = findLine(set, getTag(memaddr, params->s, params->b), params);
+    int missed = (line == NULL);
+    int first_use = 0;
+    int result;
+
+    if (line == NULL && pf->kind == PREFETCH_STREAM) {
+        line = streamBufferHit(cache, params, block, metrics);
+    }
+    if (line != NULL && line->prefetched) {
+        line->prefetched = 0;
+        pf->stats.used++;
+        if (params->counter < line->ready) {
+            pf->stats.late++;
+        }
+        first_use = 1;
+    }
+    if (line == NULL) {
+        memaddr_t* slot = &pf->pollution[block % POLLUTION_FILTER_SIZE];
+        if (*slot == block + 1) {
+            pf->stats.pollution++;
+            *slot = 0;
+        }
+    }
+
+    if (params->writes.enabled) {
+        result = policyAccess(cache, params, memaddr, metrics, store);
+    } else {
+        result = store ? updateCache(cache, params, memaddr, metrics)
+                       : loadCache(cache, params, memaddr, metrics);
+    }
+    if (result != 0) {
+        return result;
+    }
+    if (line == NULL && set->last_accessed != NULL) {
+        //a demand fill may reuse the line of an unused prefetch
+        set->last_accessed->prefetched = 0;
+    }
+
+    switch (pf->kind) {
+    case PREFETCH_NEXT_LINE:
+        if (missed || first_use) {
+            for (int k = 1; k <= pf->degree; k++) {
+                prefetchBlock(cache, params, block + k, metrics,
+                              params->counter + pf->latency);
+            }
+        }
+        break;
+    case PREFETCH_STRIDE:
+        trainStride(cache, params, memaddr, metrics);
+        break;
+    case PREFETCH_STREAM:
+        if (missed && line == NULL) {
+            allocateStreamBuffer(params, block);
+        }
+        break;
+    case PREFETCH_AMPM:
+        trainAmpm(cache, params, memaddr, metrics);
+        break;
+    }
+    return 0;
+}
+
+int
+loadPrefetch(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return prefetchAccess(cache, params, memaddr, metrics, 0);
+}
+
+int
+updatePrefetch(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return prefetchAccess(cache, params, memaddr, metrics, 1);
+}
+
+//transferCycles - cycles the memory bus needs for bytes
+unsigned long long
+transferCycles(
+    timing_t* timing,
+    long long bytes
+) {
+    if (timing->bandwidth <= 0) {
+        return 0;
+    }
+    return (bytes + timing->bandwidth - 1) / timing->bandwidth;
+}
+
+//timeMiss - a miss to block going to memory. A blocking cache waits for
+//the fill, otherwise the miss takes an MSHR, waiting for the earliest
+//outstanding miss to complete if there is none free.
+void
+timeMiss(
+    param_t* params,
+    memaddr_t block
+) {
+    timing_t* timing = &params->timing;
+    unsigned long long start = timing->clock > timing->bus_free
+                               ? timing->clock : timing->bus_free;
+    unsigned long long transfer = transferCycles(timing, params->B);
+    mshr_t* mshr;
+
+    timing->bus_free = start + transfer;
+    if (timing->mshrs == 0) {
+        timing->clock = start + timing->miss_penalty + transfer;
+        return;
+    }
+    mshr = &timing->pending[0];
+    for (int i = 1; i < timing->mshrs && mshr->done > timing->clock; i++) {
+        if (timing->pending[i].done < mshr->done) {
+            mshr = &timing->pending[i];
+        }
+    }
+    if (mshr->done > timing->clock) {
+        timing->clock = mshr->done;
+    }
+    mshr->block = block;
+    mshr->done = start + timing->miss_penalty + transfer;
+}
+
+//timeHit - a hit to a block whose fill is outstanding waits for it
+void
+timeHit(
+    param_t* params,
+    memaddr_t block
+) {
+    timing_t* timing = &params->timing;
+    for (int i = 0; i < timing->mshrs; i++) {
+        mshr_t* mshr = &timing->pending[i];
+        if (mshr->block == block && mshr->done > timing->clock) {
+            timing->clock = mshr->done;
+        }
+    }
+}
+
+//timeRecord - advances the clock by the references of one record, given
+//what it did to the cache. Misses come first, the store of an M record
+//hits the line its load missed on. Bytes written to memory by the record
+//hold the bus as well, with an L2 they go to the L2 instead.
+void
+timeRecord(
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    timing_t* timing = &params->timing;
+    memaddr_t block = memaddr >> params->b;
+    long long victim = params->writes.victim_hits - timing->victim_seen;
+    long long l2 = params->l2_fetch_hits - timing->l2_seen;
+    long long written = metrics->dirty_evicted + params->prefetch.stats.writeback_bytes
+                        - timing->prefetch_written_seen;
+
+    timing->prefetch_written_seen = params->prefetch.stats.writeback_bytes;
+    if (params->writes.enabled) {
+        written = params->writes.memory_bytes - timing->written_seen;
+        timing->written_seen = params->writes.memory_bytes;
+    }
+    timing->victim_seen = params->writes.victim_hits;
+    timing->l2_seen = params->l2_fetch_hits;
+    if (written > 0 && params->l2 == NULL) {
+        unsigned long long start = timing->clock > timing->bus_free
+                                   ? timing->clock : timing->bus_free;
+        timing->bus_free = start + transferCycles(timing, written);
+    }
+    for (int i = 0; i < metrics->misscount; i++) {
+        timing->clock += timing->hit_latency;
+        timing->refs++;
+        if (victim-- > 0) {
+            timing->clock += timing->victim_latency;
+        } else if (l2-- > 0) {
+            timing->clock += timing->l2_latency;
+        } else {
+            timeMiss(params, block);
+        }
+    }
+    for (int i = 0; i < metrics->hitcount; i++) {
+        timing->clock += timing->hit_latency;
+        timing->refs++;
+        timeHit(params, block);
+    }
+}
+
+//finishTiming - the trace ends once all outstanding misses completed
+void
+finishTiming(
+    param_t* params
+) {
+    timing_t* timing = &params->timing;
+    for (int i = 0; i < timing->mshrs; i++) {
+        if (timing->pending[i].done > timing->clock) {
+            timing->clock = timing->pending[i].done;
+        }
+    }
+    free(timing->pending);
+    timing->pending = NULL;
+}
+
+//timingSummary - the stall cycles of the timeline and the AMAT of the
+//counted hits and misses, hit_latency + miss rate * cost of a miss
+//without any overlap
+void
+timingSummary(
+    param_t* params,
+    unsigned long long* stall_cycles,
+    double* cycles_per_ref,
+    double* amat
+) {
+    timing_t* timing = &params->timing;
+    metrics_t* metrics = &params->metrics;
+    long long refs = metrics->hitcount + metrics->misscount;
+    long long victim = params->writes.victim_hits;
+    long long l2 = params->l2_fetch_hits;
+    double miss_cycles = (double) victim * timing->victim_latency
+        + (double) l2 * timing->l2_latency
+        + (double) (metrics->misscount - victim - l2)
+          * (timing->miss_penalty + transferCycles(timing, params->B));
+
+    *stall_cycles = timing->clock - (unsigned long long) timing->refs * timing->hit_latency;
+    *cycles_per_ref = timing->refs ? (double) timing->clock / timing->refs : 0.0;
+    *amat = refs ? timing->hit_latency + miss_cycles / refs : 0.0;
+}
+
+void
+printTiming(
+    param_t* params
+) {
+    unsigned long long stall;
+    double cycles_per_ref;
+    double amat;
+
+    timingSummary(params, &stall, &cycles_per_ref, &amat);
+    printf("timing: cycles:%llu stall_cycles:%llu cycles_per_ref:%.2f amat:%.2f\n",
+           params->timing.clock, stall, cycles_per_ref, amat);
+}
+
+//initTlbLevel - ways of 0 (or more than entries) make it fully associative
+int
+initTlbLevel(
+    tlb_level_t* level
+) {
+    if (level->entries <= 0) {
+        level->entries = 0;
+        return 0;
+    }
+    if (level->ways <= 0 || level->ways > level->entries) {
+        level->ways = level->entries;
+    }
+    level->sets = level->entries / level->ways;
+    level->lines = calloc((size_t) level->sets * level->ways, sizeof(tlb_entry_t));
+    return level->lines == NULL ? ERROR_INIT_CACHE : 0;
+}
+
+int
+initTlb(
+    tlb_t* tlb
+) {
+    if (initTlbLevel(&tlb->l1) != 0 || initTlbLevel(&tlb->l2) != 0
+            || initTlbLevel(&tlb->pwc) != 0) {
+        return ERROR_INIT_CACHE;
+    }
+    return 0;
+}
+
+void
+freeTlb(
+    tlb_t* tlb
+) {
+    free(tlb->l1.lines);
+    free(tlb->l2.lines);
+    free(tlb->pwc.lines);
+    tlb->l1.lines = NULL;
+    tlb->l2.lines = NULL;
+    tlb->pwc.lines = NULL;
+}
+
+//tlbLookup - looks tag up in level, filling it in on a miss. Returns 1
+//on a hit. A level without entries always misses.
+int
+tlbLookup(
+    tlb_t* tlb,
+    tlb_level_t* level,
+    memaddr_t tag
+) {
+    tlb_entry_t* set;
+    tlb_entry_t* victim;
+
+    if (level->entries == 0) {
+        return 0;
+    }
+    set = &level->lines[(tag % level->sets) * level->ways];
+    victim = &set[0];
+    for (int i = 0; i < level->ways; i++) {
+        if (set[i].valid && set[i].tag == tag) {
+            set[i].access = tlb->tick;
+            level->hits++;
+            return 1;
+        }
+        if (!set[i].valid || (victim->valid && set[i].access < victim->access)) {
+            victim = &set[i];
+        }
+    }
+    level->misses++;
+    victim->valid = 1;
+    victim->tag = tag;
+    victim->access = tlb->tick;
+    return 0;
+}
+
+//pageWalk - reads the page table entries that map memaddr, from the
+//root down to the one mapping the page. The walk cache holds non-leaf
+//entries, the walk starts below the deepest one found there. Returns
+//the cycles the walk takes.
+unsigned long long
+pageWalk(
+    tlb_t* tlb,
+    memaddr_t memaddr
+) {
+    //references of a full walk: 4 for 4K pages, 3 for 2M, 2 for 1G. The
+    //last one reads the leaf entry, which the PWC does not hold.
+    int leaf = PAGE_TABLE_LEVELS - (tlb->page_bits - PAGE_BITS_4K) / PAGE_TABLE_BITS;
+    int start = 0;
+    int refs;
+
+    //look up the deepest non-leaf level first, each lookup fills it in
+    for (int level = leaf - 2; level >= 0; level--) {
+        int shift = PAGE_BITS_4K + PAGE_TABLE_BITS * (PAGE_TABLE_LEVELS - 1 - level);
+        memaddr_t tag = ((memaddr >> shift) << 2) | level;
+        if (tlbLookup(tlb, &tlb->pwc, tag)) {
+            start = level + 1;
+            break;
+        }
+    }
+    refs = leaf - start;
+    tlb->walks++;
+    tlb->walk_refs += refs;
+    tlb->walk_cycles += (unsigned long long) refs * tlb->walk_latency;
+    return (unsigned long long) refs * tlb->walk_latency;
+}
+
+//translate - runs the page of memaddr through the TLBs, walking the page
+//tables if neither holds it. Returns the cycles translation adds to the
+//access, an L1 TLB hit is hidden behind the cache lookup.
+unsigned long long
+translate(
+    param_t* params,
+    memaddr_t memaddr
+) {
+    tlb_t* tlb = &params->tlb;
+    memaddr_t page = memaddr >> tlb->page_bits;
+
+    tlb->tick++;
+    if (tlbLookup(tlb, &tlb->l1, page)) {
+        return 0;
+    }
+    if (tlbLookup(tlb, &tlb->l2, page)) {
+        return tlb->l2_latency;
+    }
+    return (tlb->l2.entries ? tlb->l2_latency : 0) + pageWalk(tlb, memaddr);
+}
+
+void
+printTlb(
+    param_t* params
+) {
+    tlb_t* tlb = &params->tlb;
+    const char* size = tlb->page_bits == 30 ? "1G" : tlb->page_bits == 21 ? "2M" : "4K";
+
+    printf("tlb %s: l1_hits:%lld l1_misses:%lld l2_hits:%lld l2_misses:%lld "
+           "walks:%lld walk_refs:%lld pwc_hits:%lld walk_cycles:%llu\n",
+           size, tlb->l1.hits, tlb->l1.misses, tlb->l2.hits, tlb->l2.misses,
+           tlb->walks, tlb->walk_refs, tlb->pwc.hits, tlb->walk_cycles);
+}
+
+//Snapshot file: header, then one record per set holding valid lines,
+//then a record with set = SNAPSHOT_END. In compact mode access is the
+//LRU rank of the line instead of its stamp.
+#define SNAPSHOT_MAGIC "CSIMSNP1"
+#define SNAPSHOT_END UINT64_MAX
+#define SNAPSHOT_VALID 1
+#define SNAPSHOT_DIRTY 2
+
+typedef struct
+{
+    char magic[8];
+    int32_t s;
+    int32_t E;
+    int32_t b;
+    int32_t compact;
+    uint64_t counter;
+    int64_t trace_offset; //of the first record not yet simulated
+    metrics_t metrics;
+} snapshot_header_t;
+
+typedef struct
+{
+    uint64_t set;
+    uint32_t count; //snapshot_line_t records that follow
+    int32_t last_way; //way of last_accessed, -1 for none
+} snapshot_set_t;
+
+typedef struct
+{
+    uint32_t way;
+    uint32_t flags;
+    uint64_t tag;
+    uint64_t access;
+} snapshot_line_t;
+
+//saveSnapshot - written to a temporary file and renamed, a crash while
+//saving leaves the previous snapshot intact
+int
+saveSnapshot(
+    char* path,
+    param_t* params,
+    cache_t* cache,
+    long trace_offset
+) {
+    char tmp_path[4096];
+    snapshot_header_t header = {SNAPSHOT_MAGIC};
+    snapshot_set_t end = {SNAPSHOT_END, 0, -1};
+    snapshot_line_t* lines = malloc(sizeof(snapshot_line_t) * params->E);
+    FILE* fp;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL || lines == NULL) {
+        printf("Error: failed to open file - %s\n", tmp_path);
+        free(lines);
+        return ERROR_OPEN_FILE;
+    }
+    header.s = params->s;
+    header.E = params->E;
+    header.b = params->b;
+    header.compact = params->compact;
+    header.counter = params->counter;
+    header.trace_offset = trace_offset;
+    header.metrics = params->metrics;
+    fwrite(&header, sizeof(header), 1, fp);
+
+    for (long long i = 0; i < params->S; i++) {
+        snapshot_set_t set = {i, 0, -1};
+        if (params->compact) {
+            for (int j = 0; j < params->E; j++) {
+                unsigned long long meta = getCompactMeta(cache, params, i * params->E + j);
+                if (meta & COMPACT_VALID) {
+                    snapshot_line_t* line = &lines[set.count++];
+                    line->way = j;
+                    line->flags = meta & (COMPACT_VALID | COMPACT_DIRTY);
+                    line->tag = getCompactTag(cache, params, i * params->E + j);
+                    line->access = meta >> COMPACT_RANK_SHIFT;
+                }
+            }
+        } else if (cache->sets[i].lines != NULL) {
+            cache_set_t* cache_set = &cache->sets[i];
+            for (int j = 0; j < params->E; j++) {
+                cache_line_t* cache_line = &cache_set->lines[j];
+                if (cache_line->validbit) {
+                    snapshot_line_t* line = &lines[set.count++];
+                    line->way = j;
+                    line->flags = SNAPSHOT_VALID
+                                  | (cache_line->dirtybit ? SNAPSHOT_DIRTY : 0);
+                    line->tag = cache_line->tag;
+                    line->access = cache_line->access;
+                }
+            }
+            if (cache_set->last_accessed != NULL) {
+                set.last_way = cache_set->last_accessed - cache_set->lines;
+            }
+        }
+        if (set.count > 0) {
+            fwrite(&set, sizeof(set), 1, fp);
+            fwrite(lines, sizeof(snapshot_line_t), set.count, fp);
+        }
+    }
+    fwrite(&end, sizeof(end), 1, fp);
+    free(lines);
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        printf("Error: failed to write snapshot - %s\n", path);
+        remove(tmp_path);
+        return ERROR_SNAPSHOT;
+    }
+    return 0;
+}
+
+//loadSnapshot - restores the cache of a snapshot into a freshly
+//initialized cache of the same geometry and mode. With warm set only the
+//cache (and its LRU clock) is taken, metrics keep counting from zero.
+int
+loadSnapshot(
+    char* path,
+    param_t* params,
+    cache_t* cache,
+    int warm
+) {
+    snapshot_header_t header;
+    snapshot_set_t set;
+    snapshot_line_t line;
+    FILE* fp = fopen(path, "rb");
+    int result = 0;
+
+    if (fp == NULL) {
+        printf("Error: failed to open file - %s\n", path);
+        return ERROR_OPEN_FILE;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1
+            || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        printf("Error: %s is not a csim snapshot\n", path);
+        fclose(fp);
+        return ERROR_SNAPSHOT;
+    }
+    if (header.s != params->s || header.E != params->E || header.b != params->b
+            || header.compact != params->compact) {
+        printf("Error: snapshot %s is for -s %d -E %d -b %d%s\n", path,
+               header.s, header.E, header.b, header.compact ? " --compact" : "");
+        fclose(fp);
+        return ERROR_SNAPSHOT;
+    }
+
+    while (result == 0) {
+        if (fread(&set, sizeof(set), 1, fp) != 1
+                || (set.set != SNAPSHOT_END && set.set >= (uint64_t) params->S)) {
+            result = ERROR_SNAPSHOT;
+            break;
+        }
+        if (set.set == SNAPSHOT_END) {
+            break;
+        }
+        if (!params->compact && cache->sets[set.set].lines == NULL) {
+            materializeSet(cache, params, set.set);
+        }
+        for (uint32_t k = 0; k < set.count; k++) {
+            if (fread(&line, sizeof(line), 1, fp) != 1
+                    || line.way >= (uint32_t) params->E) {
+                result = ERROR_SNAPSHOT;
+                break;
+            }
+            if (params->compact) {
+                setCompactLine(cache, params, set.set * params->E + line.way,
+                               line.tag, line.flags
+                               | (line.access << COMPACT_RANK_SHIFT));
+            } else {
+                cache_line_t* cache_line = &cache->sets[set.set].lines[line.way];
+                cache_line->validbit = (line.flags & SNAPSHOT_VALID) != 0;
+                cache_line->dirtybit = (line.flags & SNAPSHOT_DIRTY) != 0;
+                cache_line->tag = line.tag;
+                cache_line->access = line.access;
+            }
+        }
+        if (!params->compact && set.last_way >= 0 && set.last_way < params->E) {
+            cache->sets[set.set].last_accessed =
+                &cache->sets[set.set].lines[set.last_way];
+        }
+    }
+    fclose(fp);
+    if (result != 0) {
+        printf("Error: snapshot %s is truncated or corrupt\n", path);
+        return result;
+    }
+
+    params->counter = header.counter;
+    params->trace_offset = header.trace_offset;
+    if (!warm) {
+        params->metrics = header.metrics;
+    } else {
+        //dirty lines of the warm cache are active, count them so that a
+        //later eviction does not take dirty_active below zero
+        metrics_t metrics = {0};
+        metrics.dirty_active = header.metrics.dirty_active;
+        params->metrics = metrics;
+    }
+    return 0;
+}
+
+void
+printMetrics(
+     char action,
+     memaddr_t memaddr,
+     int size,
+     metrics_t* metrics
+) {
+     printf("%c %llx,%d ", action, memaddr, size);
+     if (metrics->misscount) {
+        printf(" Miss ");
+     }
+     if (metrics->hitcount) {
+        printf(" Hit ");
+     }
+     if (metrics->double_accesses) {
+        printf(" Double-Ref ");
+     }
+     if (metrics->dirty_evicted){
+        printf(" Dirty-Evicted ");
+     } else if (metrics->evictcount) {
+        printf(" Eviction ");
+     }
+     printf("\n");      
+}
+
+//isSampledSet - set sampling keeps the sets whose hashed index is 0 mod
+//sample_sets, hashing spreads the kept sets over the address space
+int
+isSampledSet(
+    param_t* params,
+    memaddr_t index
+) {
+    return ((index * 0x9E3779B97F4A7C15ULL) >> 32) % params->sample_sets == 0;
+}
+
+//countReferences - cache references of a record, estimates are scaled
+//to the references of the whole trace
+void
+countReferences(
+    param_t* params,
+    char action
+) {
+    params->refs += (action == 'M') ? 2 : (action == 'L' || action == 'S');
+}
+
+//isFastForward - interval sampling neither simulates nor counts records
+//outside of windows and their warm-up
+int
+isFastForward(
+    param_t* params,
+    long long record
+) {
+    return params->window && params->warmup >= 0
+        && record % params->period
+           < params->period - params->window - params->warmup;
+}
+
+//readRecordKind - consumes one trace line and returns its action only,
+//for records that are fast-forwarded
+int
+readRecordKind(
+    FILE* fp,
+    char* action
+) {
+    char line[256];
+    char* c = line;
+
+    do {
+        if (fgets(line, sizeof(line), fp) == NULL) {
+            return 0;
+        }
+        for (c = line; *c == ' ' || *c == '\t'; c++) {
+        }
+    } while (*c == '\n'); //blank line, fscanf would skip it too
+    *action = *c;
+    //the rest of an overlong line
+    while (strchr(line, '\n') == NULL && fgets(line, sizeof(line), fp) != NULL) {
+    }
+    return 1;
+}
+
+//readRecord - reads the next ' <action> <hex address>,<size>' record,
+//returns 0 at the end of the trace or on a malformed record. Parses the
+//line by hand, fscanf costs more than the simulation of a record.
+int
+readRecord(
+    FILE* fp,
+    char* action,
+    memaddr_t* memaddr,
+    int* size
+) {
+    char line[256];
+    char* c;
+    char* end;
+
+    do {
+        if (fgets(line, sizeof(line), fp) == NULL) {
+            return 0;
+        }
+        for (c = line; *c == ' ' || *c == '\t'; c++) {
+        }
+    } while (*c == '\n'); //blank line
+    *action = *c++;
+    *memaddr = strtoull(c, &end, 16);
+    if (end == c || *end != ',') {
+        return 0;
+    }
+    c = end + 1;
+    *size = strtol(c, &end, 10);
+    if (end == c) {
+        return 0;
+    }
+    return 1;
+}
+
+//trace index, a sidecar <trace>.idx that maps record numbers to file
+//offsets. Block i starts at record i * every, its summary covers the
+//records up to the next block.
+#define TRACE_INDEX_MAGIC "CSIMTIX1"
+
+typedef struct
+{
+    char magic[8];
+    uint64_t size; //identity of the indexed trace
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint64_t every; //records per block
+    uint64_t records; //in the whole trace
+    uint64_t num_blocks; //trace_block_t records that follow
+} trace_index_header_t;
+
+typedef struct
+{
+    uint64_t offset; //file offset of the block's first record
+    uint64_t min_addr; //lowest and highest address referenced
+    uint64_t max_addr;
+    uint32_t loads;
+    uint32_t stores;
+    uint32_t modifies;
+    uint32_t instructions;
+} trace_block_t;
+
+typedef struct trace_index
+{
+    trace_index_header_t header;
+    trace_block_t* blocks;
+} trace_index_t;
+
+//buildTraceIndex - reads the whole trace once. A block is started every
+//every records, ftell is only called there.
+int
+buildTraceIndex(
+    char* trace_file,
+    struct stat* st,
+    long long every,
+    trace_index_t* index
+) {
+    FILE* fp = fopen(trace_file, "r");
+    size_t capacity = 0;
+    trace_block_t* block = NULL;
+    char action;
+    memaddr_t memaddr;
+    int size;
+
+    if (fp == NULL) {
+        printf("Error: failed to open file - %s\n", trace_file);
+        return ERROR_OPEN_FILE;
+    }
+    memset(&index->header, 0, sizeof(index->header));
+    memcpy(index->header.magic, TRACE_INDEX_MAGIC, sizeof(index->header.magic));
+    index->header.size = st->st_size;
+    index->header.mtime_sec = st->st_mtim.tv_sec;
+    index->header.mtime_nsec = st->st_mtim.tv_nsec;
+    index->header.every = every;
+    index->blocks = NULL;
+    for (;;) {
+        long offset = 0;
+        if (index->header.records % every == 0) {
+            offset = ftell(fp);
+        }
+        if (!readRecord(fp, &action, &memaddr, &size)) {
+            break;
+        }
+        if (index->header.records % every == 0) {
+            if (index->header.num_blocks == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                trace_block_t* blocks = realloc(index->blocks,
+                                                capacity * sizeof(trace_block_t));
+                if (blocks == NULL) {
+                    fclose(fp);
+                    return ERROR_TRACE_INDEX;
+                }
+                index->blocks = blocks;
+            }
+            block = &index->blocks[index->header.num_blocks++];
+            memset(block, 0, sizeof(*block));
+            block->offset = offset;
+            block->min_addr = memaddr;
+            block->max_addr = memaddr;
+        }
+        if (memaddr < block->min_addr) {
+            block->min_addr = memaddr;
+        }
+        if (memaddr > block->max_addr) {
+            block->max_addr = memaddr;
+        }
+        block->loads += (action == 'L');
+        block->stores += (action == 'S');
+        block->modifies += (action == 'M');
+        block->instructions += (action == 'I');
+        index->header.records++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+//loadTraceIndex - reads <trace>.idx, or builds it when it is missing,
+//belongs to another version of the trace or has another block size. An
+//index that cannot be saved is still used for this run.
+int
+loadTraceIndex(
+    char* trace_file,
+    long long every,
+    trace_index_t* index
+) {
+    char path[4096];
+    char tmp_path[4200];
+    struct stat st;
+    FILE* fp;
+    int result;
+
+    if (stat(trace_file, &st) != 0) {
+        printf("Error: failed to open file - %s\n", trace_file);
+        return ERROR_OPEN_FILE;
+    }
+    snprintf(path, sizeof(path), "%s.idx", trace_file);
+    index->blocks = NULL;
+    fp = fopen(path, "rb");
+    if (fp != NULL) {
+        trace_index_header_t* header = &index->header;
+        int found = fread(header, sizeof(*header), 1, fp) == 1
+            && memcmp(header->magic, TRACE_INDEX_MAGIC, sizeof(header->magic)) == 0
+            && header->size == (uint64_t) st.st_size
+            && header->mtime_sec == (uint64_t) st.st_mtim.tv_sec
+            && header->mtime_nsec == (uint64_t) st.st_mtim.tv_nsec
+            && header->every == (uint64_t) every;
+        if (found) {
+            index->blocks = malloc(header->num_blocks * sizeof(trace_block_t) + 1);
+            found = index->blocks != NULL
+                && fread(index->blocks, sizeof(trace_block_t), header->num_blocks, fp)
+                   == header->num_blocks;
+        }
+        fclose(fp);
+        if (found) {
+            return 0;
+        }
+        free(index->blocks);
+        index->blocks = NULL;
+    }
+
+    result = buildTraceIndex(trace_file, &st, every, index);
+    if (result != 0) {
+        free(index->blocks);
+        index->blocks = NULL;
+        return result;
+    }
+    //renamed into place, concurrent runs never read half an index
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long) getpid());
+    fp = fopen(tmp_path, "wb");
+    if (fp != NULL) {
+        int written = fwrite(&index->header, sizeof(index->header), 1, fp) == 1
+            && fwrite(index->blocks, sizeof(trace_block_t), index->header.num_blocks, fp)
+               == index->header.num_blocks;
+        if (fclose(fp) != 0 || !written || rename(tmp_path, path) != 0) {
+            remove(tmp_path);
+        }
+    }
+    return 0;
+}
+
+//printTraceIndex - one line per block of the index
+void
+printTraceIndex(
+    trace_index_t* index
+) {
+    printf("records:%llu blocks:%llu every:%llu\n",
+           (unsigned long long) index->header.records,
+           (unsigned long long) index->header.num_blocks,
+           (unsigned long long) index->header.every);
+    printf("record\toffset\tloads\tstores\tmodifies\tinstructions\tmin_addr\tmax_addr\n");
+    for (uint64_t i = 0; i < index->header.num_blocks; i++) {
+        trace_block_t* block = &index->blocks[i];
+        printf("%llu\t%llu\t%u\t%u\t%u\t%u\t%llx\t%llx\n",
+               (unsigned long long) (i * index->header.every),
+               (unsigned long long) block->offset, block->loads, block->stores,
+               block->modifies, block->instructions,
+               (unsigned long long) block->min_addr,
+               (unsigned long long) block->max_addr);
+    }
+}
+
+//seekRecord - positions fp at record, from the index block it is in.
+//Returns 0 with fp at the end of the trace if it has fewer records.
+int
+seekRecord(
+    FILE* fp,
+    char* trace_file,
+    param_t* params,
+    long long record
+) {
+    trace_index_t loaded;
+    trace_index_t* index = params->trace_index;
+    long long block;
+    char action;
+    int result = 0;
+
+    if (index == NULL) {
+        index = &loaded;
+        result = loadTraceIndex(trace_file, params->index_every, index);
+        if (result != 0) {
+            return result;
+        }
+    }
+    block = record / params->index_every;
+    if (index->header.num_blocks == 0) {
+        fseek(fp, 0, SEEK_END);
+        block = -1;
+    } else if ((uint64_t) block >= index->header.num_blocks) {
+        block = index->header.num_blocks - 1;
+    }
+    if (block >= 0) {
+        if (fseek(fp, index->blocks[block].offset, SEEK_SET) != 0) {
+            result = ERROR_OPEN_FILE;
+        } else {
+            for (long long i = block * params->index_every; i < record; i++) {
+                if (!readRecordKind(fp, &action)) {
+                    break;
+                }
+            }
+        }
+    }
+    if (index == &loaded) {
+        free(loaded.blocks);
+    }
+    return result;
+}
+
+//sampleUnit - the sampling unit record counts towards, SAMPLE_NONE if it
+//is simulated without being counted and SAMPLE_SKIP if it is not
+//simulated at all. Runs without sampling simulate everything.
+long long
+sampleUnit(
+    param_t* params,
+    char action,
+    memaddr_t memaddr,
+    long long record
+) {
+    long long unit = SAMPLE_NONE;
+
+    if (!params->sample_sets && !params->window) {
+        return SAMPLE_NONE;
+    }
+    countReferences(params, action);
+    if (params->sample_sets) {
+        memaddr_t index = getCacheSetIndex(memaddr, params->s, params->b);
+        if (!isSampledSet(params, index)) {
+            return SAMPLE_SKIP;
+        }
+        unit = index;
+    }
+    if (params->window) {
+        long long pos = record % params->period;
+        if (pos < params->period - params->window) {
+            if (params->warmup < 0
+                    || pos >= params->period - params->window - params->warmup) {
+                return SAMPLE_NONE;
+            }
+            return SAMPLE_SKIP;
+        }
+        unit = record / params->period;
+        if (unit >= params->num_units) {
+            params->units = realloc(params->units, sizeof(metrics_t) * (unit + 1));
+            memset(&params->units[params->num_units], 0,
+                   sizeof(metrics_t) * (unit + 1 - params->num_units));
+            params->num_units = unit + 1;
+        }
+    }
+    return unit;
+}
+
+//initSampling - units of set sampling are indexed by set, the mapping
+//is only committed for the sets that are sampled and touched
+int
+initSampling(
+    param_t* params
+) {
+    if (params->sample_sets && !params->window) {
+        params->units = allocArena(sizeof(metrics_t) * params->S,
+                                   &params->units_size);
+        if (params->units == NULL) {
+            return ERROR_INIT_CACHE;
+        }
+        params->num_units = params->S;
+    }
+    return 0;
+}
+
+//normalQuantile - z with P(-z < Z < z) = confidence for standard normal Z
+double
+normalQuantile(
+    double confidence
+) {
+    double low = 0;
+    double high = 10;
+    for (int i = 0; i < 100; i++) {
+        double mid = (low + high) / 2;
+        if (erf(mid / sqrt(2.0)) < confidence) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+//estimateMetric - ratio estimate of a per-reference count over the whole
+//trace, field is the offset of the count in metrics_t. The half width of
+//its confidence interval goes to error.
+long long
+estimateMetric(
+    param_t* params,
+    size_t field,
+    double z,
+    double f,
+    long long* error
+) {
+    double sum_x = 0;
+    double sum_a = 0;
+    double sum_d2 = 0;
+    double ratio;
+    long long n = 0;
+
+    for (long long i = 0; i < params->num_units; i++) {
+        metrics_t* unit = &params->units[i];
+        //units without references carry no information about the ratio
+        if ((params->sample_sets && !params->window && !isSampledSet(params, i))
+                || unit->hitcount + unit->misscount == 0) {
+            continue;
+        }
+        sum_x += *(int *) ((char *) unit + field);
+        sum_a += (double) unit->hitcount + unit->misscount;
+        n++;
+    }
+    if (sum_a == 0) {
+        *error = -1;
+        return 0;
+    }
+    ratio = sum_x / sum_a;
+    for (long long i = 0; i < params->num_units; i++) {
+        metrics_t* unit = &params->units[i];
+        double d;
+        if ((params->sample_sets && !params->window && !isSampledSet(params, i))
+                || unit->hitcount + unit->misscount == 0) {
+            continue;
+        }
+        d = *(int *) ((char *) unit + field)
+            - ratio * ((double) unit->hitcount + unit->misscount);
+        sum_d2 += d * d;
+    }
+    if (n > 1) {
+        double mean_a = sum_a / n;
+        double var = (1 - f) * sum_d2 / (n - 1) / (n * mean_a * mean_a);
+        *error = (long long) (z * params->refs * sqrt(var) + 0.5);
+    } else {
+        *error = -1; //one unit gives no variance, the interval is unknown
+    }
+    return (long long) (params->refs * ratio + 0.5);
+}
+
+//estimateMetrics - replaces the metrics of a sampled run by estimates
+//for the whole trace. Event counts use the ratio estimator: the count per
+//cache reference of the sampled units times all references of the trace,
+//the number of references is known exactly from parsing. dirty_active is
+//a state, it is scaled up by the fraction of sets for set sampling and
+//taken from the simulated cache for interval sampling. The metrics keep
+//the estimates cut to int for printSummary.
+void
+estimateMetrics(
+    param_t* params
+) {
+    double z = normalQuantile(params->confidence);
+    double f;
+    estimate_t estimate;
+    long long n = 0;
+
+    for (long long i = 0; i < params->num_units; i++) {
+        if (params->window || isSampledSet(params, i)) {
+            n++;
+        }
+    }
+    params->sampled = n;
+    f = params->window ? (double) params->window / params->period
+                       : (double) n / params->S;
+
+    estimate.hitcount = estimateMetric(params, offsetof(metrics_t, hitcount),
+                                       z, f, &params->error.hitcount);
+    estimate.misscount = estimateMetric(params, offsetof(metrics_t, misscount),
+                                        z, f, &params->error.misscount);
+    estimate.evictcount = estimateMetric(params, offsetof(metrics_t, evictcount),
+                                         z, f, &params->error.evictcount);
+    estimate.dirty_evicted = estimateMetric(params, offsetof(metrics_t, dirty_evicted),
+                                            z, f, &params->error.dirty_evicted);
+    estimate.double_accesses = estimateMetric(params, offsetof(metrics_t, double_accesses),
+                                              z, f, &params->error.double_accesses);
+    estimate.dirty_active = params->metrics.dirty_active;
+    params->error.dirty_active = 0;
+    if (!params->window && n > 0) {
+        double sum = 0;
+        double sum2 = 0;
+        for (long long i = 0; i < params->num_units; i++) {
+            if (isSampledSet(params, i)) {
+                sum += params->units[i].dirty_active;
+                sum2 += (double) params->units[i].dirty_active
+                        * params->units[i].dirty_active;
+            }
+        }
+        estimate.dirty_active = (long long) (sum * params->S / n + 0.5);
+        params->error.dirty_active = -1;
+        if (n > 1) {
+            double var = (sum2 - sum * sum / n) / (n - 1);
+            params->error.dirty_active =
+                (long long) (z * params->S * sqrt((1 - f) * var / n) + 0.5);
+        }
+    }
+    params->estimate = estimate;
+    params->metrics.hitcount = estimate.hitcount;
+    params->metrics.misscount = estimate.misscount;
+    params->metrics.evictcount = estimate.evictcount;
+    params->metrics.dirty_evicted = estimate.dirty_evicted;
+    params->metrics.dirty_active = estimate.dirty_active;
+    params->metrics.double_accesses = estimate.double_accesses;
+}
+
+//printSamplingError - the estimates for the metrics of printSummary in
+//full and their +- half widths, n/a where the sampled units cannot give one
+void
+printSamplingError(
+    param_t* params
+) {
+    const char* names[] = {"hits", "misses", "evictions", "dirty_bytes_evicted",
+                           "dirty_bytes_active", "double_refs"};
+    long long estimates[] = {params->estimate.hitcount, params->estimate.misscount,
+                             params->estimate.evictcount, params->estimate.dirty_evicted,
+                             params->estimate.dirty_active, params->estimate.double_accesses};
+    long long errors[] = {params->error.hitcount, params->error.misscount,
+                          params->error.evictcount, params->error.dirty_evicted,
+                          params->error.dirty_active, params->error.double_accesses};
+
+    printf("sampled %lld %s, %g%% confidence:", params->sampled,
+           params->window ? "windows" : "sets", params->confidence * 100);
+    for (int i = 0; i < 6; i++) {
+        if (errors[i] < 0) {
+            printf(" %s:%lld+-n/a", names[i], estimates[i]);
+        } else {
+            printf(" %s:%lld+-%lld", names[i], estimates[i], errors[i]);
+        }
+    }
+    printf("\n");
+}
+
+//freeSampling - units are only needed for the estimate
+void
+freeSampling(
+    param_t* params
+) {
+    if (params->units_size) {
+        munmap(params->units, params->units_size);
+    } else {
+        free(params->units);
+    }
+    params->units = NULL;
+    params->units_size = 0;
+    params->num_units = 0;
+}
+
+//selectAccess - the load and store functions of the configured cache
+void
+selectAccess(
+    param_t* params,
+    access_fn* load,
+    access_fn* update
+) {
+    *load = params->compact ? loadCompact
+        : params->prefetch.kind ? loadPrefetch
+        : params->writes.enabled ? loadPolicy
+        : params->sectors ? loadSectored
+        : params->hashed ? loadHashed
+        : params->l2 ? loadHierarchy
+        : params->num_traces ? loadMulti : loadCache;
+    *update = params->compact ? updateCompact
+        : params->prefetch.kind ? updatePrefetch
+        : params->writes.enabled ? updatePolicy
+        : params->sectors ? updateSectored
+        : params->hashed ? updateHashed
+        : params->l2 ? updateHierarchy
+        : params->num_traces ? updateMulti : updateCache;
+}
+
+//journalWriter - writer thread, writes the buffers handed to it until
+//closeJournal() says it is done
+void*
+journalWriter(
+    void* arg
+) {
+    journal_t* journal = arg;
+
+    pthread_mutex_lock(&journal->lock);
+    for (;;) {
+        while (journal->pending == NULL && !journal->done) {
+            pthread_cond_wait(&journal->cond, &journal->lock);
+        }
+        if (journal->pending == NULL) {
+            break;
+        }
+        journal_event_t* events = journal->pending;
+        size_t count = journal->pending_count;
+        pthread_mutex_unlock(&journal->lock);
+        int failed = fwrite(events, sizeof(journal_event_t), count, journal->fp) != count;
+        pthread_mutex_lock(&journal->lock);
+        journal->error |= failed;
+        journal->pending = NULL;
+        pthread_cond_broadcast(&journal->cond);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+//handOver - gives the filled buffer to the writer, once it is done with
+//the one it has, and goes on with the other buffer
+void
+handOver(
+    journal_t* journal
+) {
+    pthread_mutex_lock(&journal->lock);
+    while (journal->pending != NULL) {
+        pthread_cond_wait(&journal->cond, &journal->lock);
+    }
+    journal->pending = journal->buffers[journal->current];
+    journal->pending_count = journal->count;
+    pthread_cond_broadcast(&journal->cond);
+    pthread_mutex_unlock(&journal->lock);
+    journal->current ^= 1;
+    journal->count = 0;
+}
+
+void
+journalEvent(
+    journal_t* journal,
+    int kind,
+    unsigned long long record,
+    memaddr_t set,
+    int way,
+    memaddr_t tag,
+    int dirty
+) {
+    journal_event_t* event = &journal->buffers[journal->current][journal->count++];
+
+    event->record = record;
+    event->tag = tag;
+    event->set = set;
+    event->way = way;
+    event->kind = kind;
+    event->dirty = dirty;
+    journal->offset += sizeof(journal_event_t);
+    if (journal->count == JOURNAL_BUFFER_EVENTS) {
+        handOver(journal);
+    }
+}
+
+//journalKeyframe - all valid lines as the state after record, and the
+//keyframe's place in the index
+int
+journalKeyframe(
+    param_t* params,
+    cache_t* cache,
+    unsigned long long record
+) {
+    journal_t* journal = params->journal;
+    unsigned long long lines = 0;
+
+    if (journal->num_keyframes == journal->keyframes_size) {
+        size_t size = journal->keyframes_size ? 2 * journal->keyframes_size : 64;
+        journal_keyframe_t* keyframes =
+            realloc(journal->keyframes, size * sizeof(journal_keyframe_t));
+        if (keyframes == NULL) {
+            return ERROR_INIT_CACHE;
+        }
+        journal->keyframes = keyframes;
+        journal->keyframes_size = size;
+    }
+    journal->keyframes[journal->num_keyframes].record = record;
+    journal->keyframes[journal->num_keyframes++].offset = journal->offset;
+
+    for (long long i = 0; i < params->S; i++) {
+        for (int j = 0; cache->sets[i].lines != NULL && j < params->E; j++) {
+            lines += cache->sets[i].lines[j].validbit;
+        }
+    }
+    journalEvent(journal, JOURNAL_KEYFRAME, record, 0, 0, lines, 0);
+    for (long long i = 0; i < params->S; i++) {
+        for (int j = 0; cache->sets[i].lines != NULL && j < params->E; j++) {
+            cache_line_t* line = &cache->sets[i].lines[j];
+            if (line->validbit) {
+                journalEvent(journal, JOURNAL_FILL, record, i, j, line->tag, line->dirtybit);
+            }
+        }
+    }
+    return 0;
+}
+
+//journalAccess - runs the access with the wrapped load/update and
+//journals how the lines of its set changed. A keyframe goes first when
+//one is due.
+int
+journalAccess(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics,
+    int store
+) {
+    journal_t* journal = params->journal;
+    memaddr_t index = getCacheSetIndex(memaddr, params->s, params->b);
+    cache_set_t* set = getCacheSet(memaddr, params, cache);
+    cache_line_t* before = journal->before;
+    int result;
+
+    if (params->counter >= journal->next_keyframe) {
+        unsigned long long record = params->counter - 1;
+        if (journalKeyframe(params, cache, record) != 0) {
+            return ERROR_INIT_CACHE;
+        }
+        journal->next_keyframe = (record / params->keyframe_every + 1)
+                                 * params->keyframe_every + 1;
+    }
+    memcpy(before, set->lines, params->E * sizeof(cache_line_t));
+    result = store ? journal->update(cache, params, memaddr, metrics)
+                   : journal->load(cache, params, memaddr, metrics);
+
+    for (int i = 0; i < params->E; i++) {
+        cache_line_t* old = &before[i];
+        cache_line_t* line = &set->lines[i];
+        if (line->validbit && (!old->validbit || old->tag != line->tag)) {
+            if (old->validbit) {
+                journalEvent(journal, JOURNAL_EVICT, params->counter, index, i,
+                             old->tag, old->dirtybit);
+            }
+            journalEvent(journal, JOURNAL_FILL, params->counter, index, i,
+                         line->tag, line->dirtybit);
+        } else if (old->validbit && !line->validbit) {
+            journalEvent(journal, JOURNAL_EVICT, params->counter, index, i,
+                         old->tag, old->dirtybit);
+        } else if (line->validbit && old->dirtybit != line->dirtybit) {
+            journalEvent(journal, JOURNAL_DIRTY, params->counter, index, i,
+                         line->tag, line->dirtybit);
+        }
+    }
+    return result;
+}
+
+int
+loadJournal(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return journalAccess(cache, params, memaddr, metrics, 0);
+}
+
+int
+updateJournal(
+    cache_t* cache,
+    param_t* params,
+    memaddr_t memaddr,
+    metrics_t* metrics
+) {
+    return journalAccess(cache, params, memaddr, metrics, 1);
+}
+
+//openJournal - writes the header and starts the writer thread
+int
+openJournal(
+    param_t* params
+) {
+    journal_t* journal = calloc(1, sizeof(journal_t));
+    journal_header_t header = {{0}};
+
+    if (journal == NULL) {
+        return ERROR_INIT_CACHE;
+    }
+    journal->fp = fopen(params->journal_path, "wb");
+    journal->buffers[0] = malloc(JOURNAL_BUFFER_EVENTS * sizeof(journal_event_t));
+    journal->buffers[1] = malloc(JOURNAL_BUFFER_EVENTS * sizeof(journal_event_t));
+    journal->before = malloc(params->E * sizeof(cache_line_t));
+    if (journal->fp == NULL || journal->buffers[0] == NULL || journal->buffers[1] == NULL
+            || journal->before == NULL) {
+        printf("Error: failed to open journal - %s\n", params->journal_path);
+        if (journal->fp != NULL) {
+            fclose(journal->fp);
+        }
+        free(journal->buffers[0]);
+        free(journal->buffers[1]);
+        free(journal->before);
+        free(journal);
+        return ERROR_OPEN_FILE;
+    }
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.s = params->s;
+    header.E = params->E;
+    header.b = params->b;
+    header.keyframe_every = params->keyframe_every;
+    fwrite(&header, sizeof(header), 1, journal->fp);
+    journal->offset = sizeof(header);
+    journal->next_keyframe = 0; //the state the run starts from
+    selectAccess(params, &journal->load, &journal->update);
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->cond, NULL);
+    pthread_create(&journal->writer, NULL, journalWriter, journal);
+    params->journal = journal;
+    return 0;
+}
+
+//closeJournal - writes what is left, the keyframe index and the trailer
+int
+closeJournal(
+    param_t* params
+) {
+    journal_t* journal = params->journal;
+    journal_trailer_t trailer = {0};
+    int result;
+
+    if (journal == NULL) {
+        return 0;
+    }
+    handOver(journal);
+    pthread_mutex_lock(&journal->lock);
+    journal->done = 1;
+    pthread_cond_broadcast(&journal->cond);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_join(journal->writer, NULL);
+
+    trailer.index_offset = journal->offset;
+    trailer.num_keyframes = journal->num_keyframes;
+    memcpy(trailer.magic, JOURNAL_TRAILER_MAGIC, sizeof(trailer.magic));
+    if (journal->num_keyframes > 0
+            && fwrite(journal->keyframes, sizeof(journal_keyframe_t),
+                      journal->num_keyframes, journal->fp) != journal->num_keyframes) {
+        journal->error = 1;
+    }
+    if (fwrite(&trailer, sizeof(trailer), 1, journal->fp) != 1) {
+        journal->error = 1;
+    }
+    result = fclose(journal->fp) != 0 || journal->error;
+    if (result) {
+        printf("Error: failed to write journal - %s\n", params->journal_path);
+    }
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->cond);
+    free(journal->buffers[0]);
+    free(journal->buffers[1]);
+    free(journal->keyframes);
+    free(journal->before);
+    free(journal);
+    params->journal = NULL;
+    return result ? ERROR_OPEN_FILE : 0;
+}
+
+//simulateAccess - runs one access of a record through the cache
+int
+simulateAccess(
+    cache_t* cache,
+    param_t* params,
+    char action,
+    memaddr_t memaddr,
+    int size,
+    metrics_t* metrics
+) {
+    int result = 0;
+    access_fn load = loadCache;
+    access_fn update = updateCache;
+
+    if (params->journal != NULL) {
+        load = loadJournal;
+        update = updateJournal;
+    } else {
+        selectAccess(params, &load, &update);
+    }
+    params->access_size = size;
+
+    switch(action)
+    {
+    case 'I':
+        if (params->icache != NULL) {
+            fetchInstruction(params, memaddr);
+        }
+        break; 
+    
+    case 'L':
+        if (!filterAccess(cache, params, 'L', memaddr, metrics)) {
+            flushFilter(params);
+            result = load(cache, params, memaddr, metrics); 
+            addMetrics(&params->metrics, metrics);
+            startFilterRun(params, cache, memaddr);
+        }
+        break; 
+
+    case 'S':
+        if (!filterAccess(cache, params, 'S', memaddr, metrics)) {
+            flushFilter(params);
+            result = update(cache, params, memaddr, metrics);
+            addMetrics(&params->metrics, metrics);
+            startFilterRun(params, cache, memaddr);
+        }
+        break; 
+    
+    case 'M':
+        if (!filterAccess(cache, params, 'M', memaddr, metrics)) {
+            flushFilter(params);
+            result = load(cache, params, memaddr, metrics);
+            if (result != 0) { 
+               printf("Error - loadCache failed\n");
+               return result;
+            }
+            addMetrics(&params->metrics, metrics);
+            startFilterRun(params, cache, memaddr);
+            //the store hits the line the load just brought in, unless a
+            //prefetch triggered by the load has already evicted it
+            if (!filterAccess(cache, params, 'S', memaddr, metrics)) {
+                metrics_t store = {0};
+                result = update(cache, params, memaddr, &store);
+                addMetrics(&params->metrics, &store);
+                addMetrics(metrics, &store);
+                startFilterRun(params, cache, memaddr);
+            }
+        }
+        break; 
+    
+    default: 
+        break; 
+    }
+    return result;
+}
+
+//simulateRecord - runs one trace record through the cache. metrics gets
+//what this record did, the totals in params are updated as well. With
+//split_accesses a record crossing block boundaries is one access per
+//block it touches, otherwise (like csim-ref) only its first block counts.
+int
+simulateRecord(
+    cache_t* cache,
+    param_t* params,
+    char action,
+    memaddr_t memaddr,
+    int size,
+    metrics_t* metrics
+) {
+    int result = 0;
+    unsigned long long translation = 0;
+    memaddr_t end = memaddr + (size > 0 ? size : 1);
+
+    if (params->tlb.enabled && action != 'I') {
+        translation = translate(params, memaddr);
+    }
+    if (!params->split_accesses || ((end - 1) >> params->b) == (memaddr >> params->b)) {
+        result = simulateAccess(cache, params, action, memaddr, size, metrics);
+    } else {
+        memaddr_t chunk = memaddr;
+        while (result == 0 && chunk < end) {
+            memaddr_t next = ((chunk >> params->b) + 1) << params->b;
+            if (next > end || next == 0) {
+                next = end;
+            }
+            metrics_t part = {0};
+            result = simulateAccess(cache, params, action, chunk, next - chunk, &part);
+            addMetrics(metrics, &part);
+            chunk = next;
+        }
+    }
+    if (verbose && action != 'I') {
+        printMetrics(action, memaddr, size, metrics);
+    }
+    if (params->timing.enabled) {
+        params->timing.clock += translation;
+        timeRecord(params, memaddr, metrics);
+    }
+    return result;
+}
+
+//startCounting - the warm-up before a range ends, what it did is not
+//counted. Its dirty lines are active, like with --warm.
+void
+startCounting(
+    param_t* params
+) {
+    metrics_t metrics = {0};
+
+    flushFilter(params);
+    metrics.dirty_active = params->metrics.dirty_active;
+    params->metrics = metrics;
+    params->sector_misses = 0;
+    params->fetched_bytes = 0;
+}
+
+int
+parseTraceFile(
+    char* file_path,
+    param_t* params,
+    cache_t* cache
+) {
+    int result = 0;
+    FILE *tmp = NULL; //trace file 
+    char action;
+    memaddr_t memaddr;
+    int size;
+    long long records = 0;
+    long long unit;
+    long long limit = params->max_records;
+    long long warmup = 0; //records before the range
+
+    PROFILE_START(open_start);
+    tmp = fopen(file_path, "r"); 
+    if (tmp == NULL) {
         printf("Error: failed to open file - %s\n", file_path);
         return ERROR_OPEN_FILE;
     }
+    if (params->trace_offset != 0
+            && fseek(tmp, params->trace_offset, SEEK_SET) != 0) {
+        printf("Error: failed to seek in file - %s\n", file_path);
+        fclose(tmp);
+        return ERROR_OPEN_FILE;
+    }
+    if (params->range_start || params->range_end) {
+        long long first = params->range_start - params->range_warmup;
+        if (first < 0) {
+            first = 0;
+        }
+        result = seekRecord(tmp, file_path, params, first);
+        if (result != 0) {
+            printf("Error: failed to seek in file - %s\n", file_path);
+            fclose(tmp);
+            return result;
+        }
+        warmup = params->range_start - first;
+        limit = params->range_end ? params->range_end - first : 0;
+        params->counter = first; //record numbers of the journal stay absolute
+    }
+    PROFILE_PHASE(PHASE_OPEN, open_start);
+
+    while (limit == 0 || records < limit)
+    {
+        metrics_t metrics = {0};
+        if (warmup && records == warmup) {
+            startCounting(params);
+        }
+        if (isFastForward(params, records)) {
+            if (!readRecordKind(tmp, &action)) {
+                break;
+            }
+            countReferences(params, action);
+            params->counter++;
+            records++;
+            continue;
+        }
+        PROFILE_START(parse_start);
+        if (!readRecord(tmp, &action, &memaddr, &size)) {
+            break;
+        }
+        PROFILE_PHASE(PHASE_PARSE, parse_start);
+        params->counter++;
+        unit = sampleUnit(params, action, memaddr, records);
+        if (unit != SAMPLE_SKIP) {
+            PROFILE_START(access_start);
+            result = simulateRecord(cache, params, action, memaddr, size, &metrics);
+            PROFILE_ACCESS(access_start);
+        }
+        if (unit >= 0) {
+            addMetrics(&params->units[unit], &metrics);
+        }
+        if (result != 0)  {
+           break;
+        }
+        records++;
+        if (params->checkpoint_every && records % params->checkpoint_every == 0) {
+            flushFilter(params);
+            result = saveSnapshot(params->checkpoint, params, cache, ftell(tmp));
+            if (result != 0) {
+                break;
+            }
+        }
+    }
+    if (records < warmup) {
+        startCounting(params); //the range starts after the end of the trace
+    }
+    flushFilter(params);
+    if (result == 0 && params->checkpoint != NULL) {
+        result = saveSnapshot(params->checkpoint, params, cache, ftell(tmp));
+    }
+    
+    fclose(tmp);
+
+    return result;
+}
+
+//parseTraces - replays params->traces round-robin, quantum records of a
+//trace at a time, until all of them ended. A switch ends the filter run,
+//the next trace's block at the same address is a different line.
+int
+parseTraces(
+    param_t* params,
+    cache_t* cache
+) {
+    FILE* files[params->num_traces];
+    int live = 0;
+    int result = 0;
+    char action;
+    memaddr_t memaddr;
+    int size;
+
+    PROFILE_START(open_start);
+    for (int i = 0; i < params->num_traces; i++) {
+        files[i] = fopen(params->traces[i], "r");
+        if (files[i] == NULL) {
+            printf("Error: failed to open file - %s\n", params->traces[i]);
+            result = ERROR_OPEN_FILE;
+        } else {
+            live++;
+        }
+    }
+    PROFILE_PHASE(PHASE_OPEN, open_start);
+    for (int i = 0; result == 0 && live > 0; i = (i + 1) % params->num_traces) {
+        if (files[i] == NULL) {
+            continue;
+        }
+        flushFilter(params);
+        params->filter.line = NULL;
+        params->asid = i;
+        for (long long n = 0; n < params->quantum; n++) {
+            metrics_t metrics = {0};
+            PROFILE_START(parse_start);
+            if (!readRecord(files[i], &action, &memaddr, &size)) {
+                fclose(files[i]);
+                files[i] = NULL;
+                live--;
+                break;
+            }
+            PROFILE_PHASE(PHASE_PARSE, parse_start);
+            params->counter++;
+            PROFILE_START(access_start);
+            result = simulateRecord(cache, params, action, memaddr, size, &metrics);
+            PROFILE_ACCESS(access_start);
+            addMetrics(&params->trace_metrics[i], &metrics);
+            if (result != 0) {
+                break;
+            }
+        }
+    }
+    flushFilter(params);
+    for (int i = 0; i < params->num_traces; i++) {
+        if (files[i] != NULL) {
+            fclose(files[i]);
+        }
+    }
+    return result;
+}
+
+//fnv1a - 64-bit FNV-1a hash of len bytes, continuing from hash
+unsigned long long
+fnv1a(
+    unsigned long long hash,
+    const void* data,
+    size_t len
+) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+//hashTraceFile - content hash of a trace. Hashing reads the whole file,
+//so the hash is remembered in the result cache next to the file's
+//identity (device, inode, size, mtime) and only redone when any changes.
+int
+hashTraceFile(
+    char* dir,
+    char* trace_file,
+    unsigned long long* hash
+) {
+    char index_path[4096];
+    char tmp_path[4200];
+    char buf[1 << 16];
+    struct stat st;
+    unsigned long long dev, ino, size, sec, nsec, stored;
+    FILE* fp;
+    size_t len;
+
+    if (stat(trace_file, &st) != 0) {
+        return ERROR_OPEN_FILE;
+    }
+    snprintf(index_path, sizeof(index_path), "%s/trace-%016llx", dir,
+             fnv1a(FNV_OFFSET, trace_file, strlen(trace_file)));
+    fp = fopen(index_path, "r");
+    if (fp != NULL) {
+        int found = fscanf(fp, "%llu %llu %llu %llu %llu %llx",
+                           &dev, &ino, &size, &sec, &nsec, &stored) == 6
+            && dev == (unsigned long long) st.st_dev
+            && ino == (unsigned long long) st.st_ino
+            && size == (unsigned long long) st.st_size
+            && sec == (unsigned long long) st.st_mtim.tv_sec
+            && nsec == (unsigned long long) st.st_mtim.tv_nsec;
+        fclose(fp);
+        if (found) {
+            *hash = stored;
+            return 0;
+        }
+    }
+
+    fp = fopen(trace_file, "r");
+    if (fp == NULL) {
+        return ERROR_OPEN_FILE;
+    }
+    *hash = FNV_OFFSET;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        *hash = fnv1a(*hash, buf, len);
+    }
+    fclose(fp);
+
+    //written to a temporary file and renamed, like storeResult, so that
+    //concurrent runs never read a partial sidecar
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.%lx", index_path,
+             (long) getpid(), (unsigned long) pthread_self());
+    fp = fopen(tmp_path, "w");
+    if (fp != NULL) {
+        fprintf(fp, "%llu %llu %llu %llu %llu %016llx\n",
+                (unsigned long long) st.st_dev, (unsigned long long) st.st_ino,
+                (unsigned long long) st.st_size,
+                (unsigned long long) st.st_mtim.tv_sec,
+                (unsigned long long) st.st_mtim.tv_nsec, *hash);
+        if (fclose(fp) != 0 || rename(tmp_path, index_path) != 0) {
+            remove(tmp_path);
+        }
+    }
+    return 0;
+}
+
+//describeConfig - every option that changes the simulated metrics of a
+//run simulateCached stores, in a fixed order. Stored results are only
+//reused when this matches. Runs with any other simulation option are
+//never stored, describeOptions names those.
+void
+describeConfig(
+    param_t* params,
+    char* buf,
+    size_t size
+) {
+    //the policy is always the default for a stored run, it is spelled out
+    //for the report
+    int len = snprintf(buf, size, "s=%d E=%d b=%d policy=lru,%s,%s",
+                       params->s, params->E, params->b,
+                       params->writes.write_through ? "write-through" : "write-back",
+                       params->writes.no_write_allocate ? "no-write-allocate"
+                                                        : "write-allocate");
+    if (params->split_accesses) {
+        len += snprintf(buf + len, size - len, " split");
+    }
+    if (params->hashed) {
+        len += snprintf(buf + len, size - len, " index=%s sets=%lld",
+                        index_names[params->index_kind], params->num_sets);
+    }
+}
+
+//describeOptions - appends the simulation options describeConfig leaves
+//out, the ones that keep a run out of the result cache
+void
+describeOptions(
+    param_t* params,
+    char* buf,
+    size_t size
+) {
+    int len = strlen(buf);
+
+    if (params->sample_sets || params->window) {
+        len += snprintf(buf + len, size - len, " sample=%d:%lld:%lld:%lld:%g",
+                        params->sample_sets, params->window, params->warmup,
+                        params->period, params->confidence);
+    }
+    if (params->prefetch.kind != PREFETCH_NONE) {
+        len += snprintf(buf + len, size - len, " prefetch=%s:%d:%d:%d",
+                        prefetch_names[params->prefetch.kind],
+                        params->prefetch.degree, params->prefetch.latency,
+                        params->prefetch.num_buffers);
+    }
+    if (params->icache_geometry.E || params->l2_geometry.E) {
+        len += snprintf(buf + len, size - len, " icache=%d:%d:%d l2=%d:%d:%d",
+                        params->icache_geometry.s, params->icache_geometry.E,
+                        params->icache_geometry.b, params->l2_geometry.s,
+                        params->l2_geometry.E, params->l2_geometry.b);
+    }
+    if (params->writes.buffer_entries || params->writes.victim_lines) {
+        len += snprintf(buf + len, size - len, " write-buffer=%d victim-cache=%d",
+                        params->writes.buffer_entries, params->writes.victim_lines);
+    }
+    if (params->timing.enabled) {
+        timing_t* timing = &params->timing;
+        len += snprintf(buf + len, size - len, " timing=%d:%d:%d:%d:%d:%d",
+                        timing->hit_latency, timing->miss_penalty, timing->bandwidth,
+                        timing->mshrs, timing->victim_latency, timing->l2_latency);
+    }
+    if (params->tlb.enabled) {
+        tlb_t* tlb = &params->tlb;
+        len += snprintf(buf + len, size - len, " tlb=%d:%d:%d:%d page-bits=%d pwc=%d "
+                        "walk-latency=%d tlb-l2-latency=%d",
+                        tlb->l1.entries, tlb->l1.ways, tlb->l2.entries, tlb->l2.ways,
+                        tlb->page_bits, tlb->pwc.entries, tlb->walk_latency,
+                        tlb->l2_latency);
+    }
+    if (params->sectors) {
+        len += snprintf(buf + len, size - len, " sectors=%d", params->sectors);
+    }
+    if (params->num_traces) {
+        len += snprintf(buf + len, size - len, " traces=%d quantum=%lld",
+                        params->num_traces, params->quantum);
+        //masks beyond what fits are left out, the options after them are not
+        for (int i = 0; params->way_masks != NULL && i < params->num_traces
+                        && (size_t) len + 512 < size; i++) {
+            len += snprintf(buf + len, size - len, "%s%#llx", i ? "," : " cat=",
+                            params->way_masks[i]);
+        }
+    }
+    if (params->restore != NULL) {
+        len += snprintf(buf + len, size - len, " %s=%.256s",
+                        params->warm ? "warm" : "resume", params->restore);
+    }
+    if (params->max_records) {
+        len += snprintf(buf + len, size - len, " count=%lld", params->max_records);
+    }
+    if (params->range_start || params->range_end) {
+        len += snprintf(buf + len, size - len, " range=%lld:%lld range-warmup=%lld",
+                        params->range_start, params->range_end, params->range_warmup);
+    }
+    if (params->num_range_rows) {
+        len += snprintf(buf + len, size - len, " ranges=%d range-warmup=%lld",
+                        params->num_range_rows, params->range_warmup);
+    }
+}
+
+//resultPath - file of the stored result for key
+void
+resultPath(
+    char* dir,
+    char* key,
+    char* path,
+    size_t size
+) {
+    snprintf(path, size, "%s/result-%016llx", dir,
+             fnv1a(FNV_OFFSET, key, strlen(key)));
+}
+
+//loadResult - returns 1 and fills metrics when a result for key is stored
+int
+loadResult(
+    char* dir,
+    char* key,
+    metrics_t* metrics
+) {
+    char path[4096];
+    char stored[4096];
+    FILE* fp;
+    int found;
+
+    resultPath(dir, key, path, sizeof(path));
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    //the key is stored in full, a hash collision must not return a result
+    found = fgets(stored, sizeof(stored), fp) != NULL
+        && strncmp(stored, key, strlen(key)) == 0 && stored[strlen(key)] == '\n'
+        && fscanf(fp, "%d %d %d %d %d %d",
+                  &metrics->hitcount, &metrics->misscount, &metrics->evictcount,
+                  &metrics->dirty_evicted, &metrics->dirty_active,
+                  &metrics->double_accesses) == 6;
+    fclose(fp);
+    return found;
+}
+
+//storeResult - written to a temporary file and renamed, so concurrent
+//runs (or batch workers) never see half a result
+void
+storeResult(
+    char* dir,
+    char* key,
+    metrics_t* metrics
+) {
+    char path[4096];
+    char tmp_path[4200];
+    FILE* fp;
+
+    resultPath(dir, key, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.%lx", path,
+             (long) getpid(), (unsigned long) pthread_self());
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        return;
+    }
+    fprintf(fp, "%s\n%d %d %d %d %d %d\n", key,
+            metrics->hitcount, metrics->misscount, metrics->evictcount,
+            metrics->dirty_evicted, metrics->dirty_active,
+            metrics->double_accesses);
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+    }
+}
+
+//resultKey - trace content hash, config and simulator version. Returns
+//non-zero if the trace cannot be hashed.
+int
+resultKey(
+    char* dir,
+    char* trace_file,
+    param_t* params,
+    char* key,
+    size_t size
+) {
+    unsigned long long hash;
+    char config[1024];
+
+    if (hashTraceFile(dir, trace_file, &hash) != 0) {
+        return ERROR_OPEN_FILE;
+    }
+    describeConfig(params, config, sizeof(config));
+    snprintf(key, size, "csim-%s trace=%016llx %s", CSIM_VERSION, hash, config);
+    return 0;
+}
+
+//simulate - sets up a cache for the geometry in params and runs the trace
+//through it. The caller frees the cache.
+int
+simulate(
+    char* trace_file,
+    param_t* params,
+    cache_t* cache
+) {
+    int result = 0;
+
+    params->S = pow(2.0, params->s); //S = 2^s
+    params->B = pow(2.0, params->b); //B = 2^b
+    params->t = 64 - params->s - params->b; 
+    if (params->num_sets) {
+        params->S = params->num_sets;
+    }
+    if (params->hashed) {
+        initIndex(params);
+    }
+
+    if (params->compact) {
+        result = initCompact(params, cache);
+    } else {
+        result = init(params, cache); //initialize cache
+    }
+    if (result != 0) {
+        printf("Error: failed to initialize cache\n");
+        return ERROR_INIT_CACHE;
+    }
+    if (params->restore != NULL) {
+        result = loadSnapshot(params->restore, params, cache, params->warm);
+        if (result != 0) {
+            return result;
+        }
+    }
+    result = initSampling(params);
+    if (result != 0) {
+        printf("Error: failed to initialize sampling\n");
+        return result;
+    }
+    if (params->prefetch.kind != PREFETCH_NONE
+            && initPrefetcher(&params->prefetch) != 0) {
+        printf("Error: failed to initialize prefetcher\n");
+        return ERROR_INIT_CACHE;
+    }
+    if (params->writes.enabled && initWritePolicy(params) != 0) {
+        printf("Error: failed to initialize write buffer or victim cache\n");
+        freeWritePolicy(&params->writes);
+        return ERROR_INIT_CACHE;
+    }
+    if (params->icache_geometry.E) {
+        params->icache = initLevel(params, &params->icache_geometry);
+        if (params->icache == NULL) {
+            printf("Error: failed to initialize I-cache\n");
+            return ERROR_INIT_CACHE;
+        }
+    }
+    if (params->l2_geometry.E) {
+        params->l2 = initLevel(params, &params->l2_geometry);
+        if (params->l2 == NULL) {
+            printf("Error: failed to initialize L2\n");
+            freeLevel(params->icache, &params->icache_metrics);
+            params->icache = NULL;
+            return ERROR_INIT_CACHE;
+        }
+    }
+    if (params->tlb.enabled && initTlb(&params->tlb) != 0) {
+        printf("Error: failed to initialize TLB\n");
+        freeTlb(&params->tlb);
+        return ERROR_INIT_CACHE;
+    }
+    if (params->timing.mshrs > 0) {
+        params->timing.pending = calloc(params->timing.mshrs, sizeof(mshr_t));
+        if (params->timing.pending == NULL) {
+            printf("Error: failed to initialize MSHRs\n");
+            return ERROR_INIT_CACHE;
+        }
+    }
+
+    if (params->journal_path != NULL) {
+        result = openJournal(params);
+        if (result != 0) {
+            return result;
+        }
+    }
+    if (params->num_traces) {
+        result = parseTraces(params, cache);
+    } else {
+        result = parseTraceFile(trace_file, params, cache); 
+    }
+    if (result == 0 && (params->sample_sets || params->window)) {
+        estimateMetrics(params);
+    }
+    if (params->journal != NULL) {
+        int closed = closeJournal(params);
+        result = result != 0 ? result : closed;
+    }
+    if (params->writes.enabled) {
+        finishWrites(params);
+    }
+    if (params->timing.enabled) {
+        finishTiming(params);
+    }
+    freeSampling(params);
+    freePrefetcher(&params->prefetch);
+    freeWritePolicy(&params->writes);
+    freeTlb(&params->tlb);
+    freeLevel(params->icache, &params->icache_metrics);
+    freeLevel(params->l2, &params->l2_metrics);
+    params->icache = NULL;
+    params->l2 = NULL;
+    return result;
+}
+
+//simulateCached - simulate() through the result cache, if there is one.
+//Verbose runs always simulate, they print every access.
+int
+simulateCached(
+    char* trace_file,
+    param_t* params,
+    cache_t* cache
+) {
+    char key[2048];
+    int result;
+
+    //runs that start from or stop at a snapshot, or simulate a range,
+    //cover part of a trace. Only metrics are stored so runs reporting
+    //more are not cached either.
+    if (params->result_cache == NULL || verbose
+            || params->restore != NULL || params->max_records != 0
+            || params->range_start || params->range_end
+            || params->checkpoint != NULL
+            || params->sample_sets || params->window
+            || params->prefetch.kind != PREFETCH_NONE || params->writes.enabled
+            || params->timing.enabled || params->tlb.enabled || params->sectors
+            || params->icache_geometry.E || params->l2_geometry.E
+            || params->num_traces || params->journal_path != NULL
+            || resultKey(params->result_cache, trace_file, params,
+                         key, sizeof(key)) != 0) {
+        return simulate(trace_file, params, cache);
+    }
+    if (loadResult(params->result_cache, key, &params->metrics)) {
+        return 0;
+    }
+    result = simulate(trace_file, params, cache);
+    if (result == 0) {
+        storeResult(params->result_cache, key, &params->metrics);
+    }
+    return result;
+}
+
+//one line of a batch manifest
+typedef struct
+{
+    char* trace_file;
+    param_t params; //geometry in, metrics out
+    long long size; //trace file size, biggest jobs are handed out first
+    int result;
+} job_t;
+
+//per worker deque of job indices. The owner takes from the bottom,
+//idle workers steal from the top.
+typedef struct
+{
+    int* jobs;
+    int top;
+    int bottom;
+    pthread_mutex_t lock;
+} job_queue_t;
+
+typedef struct
+{
+    job_t* jobs;
+    job_queue_t* queues;
+    int num_workers;
+    int id; //index of the worker this argument belongs to
+} worker_t;
+
+//takeJob - next job index of queue, from its bottom or (steal) its top,
+//-1 when it is empty
+int
+takeJob(
+    job_queue_t* queue,
+    int steal
+) {
+    int job = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->top < queue->bottom) {
+        job = steal ? queue->jobs[queue->top++] : queue->jobs[--queue->bottom];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+void*
+batchWorker(
+    void* arg
+) {
+    worker_t* worker = (worker_t *) arg;
+
+    for (;;) {
+        int job = takeJob(&worker->queues[worker->id], 0);
+
+        //own queue is empty, try everybody else starting with the next one
+        for (int i = 1; job < 0 && i < worker->num_workers; i++) {
+            job = takeJob(&worker->queues[(worker->id + i) % worker->num_workers], 1);
+        }
+        if (job < 0) {
+            //jobs never create jobs, so there is nothing left anywhere
+            PROFILE_MERGE();
+            return NULL;
+        }
+
+        cache_t cache = {0};
+        job_t* current = &worker->jobs[job];
+        current->result = simulateCached(current->trace_file, &current->params, &cache);
+        free_cache(&cache);
+    }
+}
+
+int
+compareJobSize(
+    const void* a,
+    const void* b
+) {
+    long long size_a = (*(job_t * const *) a)->size;
+    long long size_b = (*(job_t * const *) b)->size;
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+//readManifest - parses 'trace s E b' lines, blank lines and lines starting
+//with '#' are skipped. Every job starts from a copy of defaults.
+int
+readManifest(
+    char* manifest,
+    param_t* defaults,
+    job_t** jobs,
+    int* num_jobs
+) {
+    FILE* fp = fopen(manifest, "r");
+    char line[4096];
+    char trace[4096];
+    int capacity = 0;
+    int lineno = 0;
+
+    if (fp == NULL) {
+        printf("Error: failed to open file - %s\n", manifest);
+        return ERROR_OPEN_FILE;
+    }
+    *jobs = NULL;
+    *num_jobs = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        param_t params = *defaults;
+        struct stat st;
+        char first;
+
+        lineno++;
+        if (sscanf(line, " %c", &first) != 1 || first == '#') {
+            continue;
+        }
+        if (sscanf(line, "%4095s %d %d %d", trace, &params.s, &params.E, &params.b) != 4
+                || params.s < 0 || params.b < 0 || params.E < 1
+                || params.s + params.b >= MEMADDR_BITSIZE) {
+            printf("Error: %s:%d: expected 'trace s E b'\n", manifest, lineno);
+            fclose(fp);
+            return ERROR_BAD_MANIFEST;
+        }
+        if (*num_jobs == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            *jobs = realloc(*jobs, sizeof(job_t) * capacity);
+        }
+        job_t* job = &(*jobs)[(*num_jobs)++];
+        job->trace_file = strdup(trace);
+        job->params = params;
+        job->size = (stat(trace, &st) == 0) ? st.st_size : 0;
+        job->result = 0;
+    }
+    fclose(fp);
+    return 0;
+}
+
+//runJobs - simulates jobs on num_workers threads, results are left in
+//the jobs
+void
+runJobs(
+    job_t* jobs,
+    int num_jobs,
+    int num_workers
+) {
+    job_t** order;
+    job_queue_t* queues;
+    worker_t* workers;
+    pthread_t* threads;
+
+    if (num_workers > num_jobs) {
+        num_workers = num_jobs;
+    }
+    if (num_workers < 1) {
+        num_workers = 1;
+    }
+    //deal the jobs out biggest first, so each queue starts with a similar
+    //amount of work and the long traces are not left for the end
+    order = malloc(sizeof(job_t*) * (num_jobs + 1));
+    for (int i = 0; i < num_jobs; i++) {
+        order[i] = &jobs[i];
+    }
+    qsort(order, num_jobs, sizeof(job_t*), compareJobSize);
+    queues = calloc(num_workers, sizeof(job_queue_t));
+    workers = calloc(num_workers, sizeof(worker_t));
+    threads = calloc(num_workers, sizeof(pthread_t));
+    for (int w = 0; w < num_workers; w++) {
+        queues[w].jobs = malloc(sizeof(int) * (num_jobs / num_workers + 1));
+        pthread_mutex_init(&queues[w].lock, NULL);
+    }
+    //the owner pops from the bottom, so push in reverse to run big ones first
+    for (int i = num_jobs - 1; i >= 0; i--) {
+        job_queue_t* queue = &queues[i % num_workers];
+        queue->jobs[queue->bottom++] = order[i] - jobs;
+    }
+    for (int w = 0; w < num_workers; w++) {
+        workers[w].jobs = jobs;
+        workers[w].queues = queues;
+        workers[w].num_workers = num_workers;
+        workers[w].id = w;
+        if (w > 0) {
+            pthread_create(&threads[w], NULL, batchWorker, &workers[w]);
+        }
+    }
+    batchWorker(&workers[0]);
+    for (int w = 1; w < num_workers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    for (int w = 0; w < num_workers; w++) {
+        pthread_mutex_destroy(&queues[w].lock);
+        free(queues[w].jobs);
+    }
+    free(threads);
+    free(workers);
+    free(queues);
+    free(order);
+}
+
+//runBatch - simulates every job of the manifest on num_workers threads and
+//prints one row per job, in manifest order
+int
+runBatch(
+    char* manifest,
+    param_t* defaults,
+    int num_workers
+) {
+    job_t* jobs;
+    int num_jobs;
+    int result = readManifest(manifest, defaults, &jobs, &num_jobs);
+    if (result != 0) {
+        return result;
+    }
+    runJobs(jobs, num_jobs, num_workers);
+    for (int i = 0; i < num_jobs; i++) {
+        job_t* job = &jobs[i];
+        metrics_t* m = &job->params.metrics;
+        if (job->result != 0) {
+            printf("%s (%d,%d,%d) error:%d\n", job->trace_file,
+                   job->params.s, job->params.E, job->params.b, job->result);
+            result = job->result;
+            continue;
+        }
+        printf("%s (%d,%d,%d) hits:%d misses:%d evictions:%d "
+               "dirty_bytes_evicted:%d dirty_bytes_active:%d double_refs:%d\n",
+               job->trace_file, job->params.s, job->params.E, job->params.b,
+               m->hitcount, m->misscount, m->evictcount,
+               m->dirty_evicted, m->dirty_active, m->double_accesses);
+    }
+    for (int i = 0; i < num_jobs; i++) {
+        free(jobs[i].trace_file);
+    }
+    free(jobs);
+    return result;
+}
+
+//runRanges - splits the trace into num_ranges ranges of about the same
+//number of records and simulates them independently on num_workers
+//threads, each on a cold cache warmed up by params->range_warmup records.
+//The sum of the ranges is left in params, it approximates a full run
+//when the warm-up covers the cache's reach.
+int
+runRanges(
+    char* trace_file,
+    param_t* params,
+    int num_ranges,
+    int num_workers
+) {
+    trace_index_t index;
+    job_t* jobs;
+    long long records;
+    int result = loadTraceIndex(trace_file, params->index_every, &index);
+
+    if (result != 0) {
+        return result;
+    }
+    records = index.header.records;
+    if (num_ranges > records) {
+        num_ranges = records > 0 ? records : 1;
+    }
+    jobs = calloc(num_ranges, sizeof(job_t));
+    if (jobs == NULL) {
+        free(index.blocks);
+        return ERROR_INIT_CACHE;
+    }
+    //the jobs only read the index, one copy serves them all even when
+    //the .idx could not be written
+    for (int i = 0; i < num_ranges; i++) {
+        jobs[i].trace_file = trace_file;
+        jobs[i].params = *params;
+        jobs[i].params.trace_index = &index;
+        jobs[i].params.range_start = records * i / num_ranges;
+        jobs[i].params.range_end = records * (i + 1) / num_ranges;
+        jobs[i].size = jobs[i].params.range_end - jobs[i].params.range_start;
+    }
+    runJobs(jobs, num_ranges, num_workers);
+    free(index.blocks);
+    params->range_rows = calloc(num_ranges, sizeof(range_row_t));
+    if (params->range_rows == NULL) {
+        free(jobs);
+        return ERROR_INIT_CACHE;
+    }
+    params->num_range_rows = num_ranges;
+    for (int i = 0; i < num_ranges; i++) {
+        param_t* range = &jobs[i].params;
+        metrics_t* m = &range->metrics;
+        params->range_rows[i].start = range->range_start;
+        params->range_rows[i].end = range->range_end;
+        params->range_rows[i].error = jobs[i].result;
+        params->range_rows[i].metrics = *m;
+        if (jobs[i].result != 0) {
+            printf("range %lld:%lld error:%d\n", range->range_start,
+                   range->range_end, jobs[i].result);
+            result = jobs[i].result;
+            continue;
+        }
+        printf("range %lld:%lld hits:%d misses:%d evictions:%d "
+               "dirty_bytes_evicted:%d dirty_bytes_active:%d double_refs:%d\n",
+               range->range_start, range->range_end,
+               m->hitcount, m->misscount, m->evictcount,
+               m->dirty_evicted, m->dirty_active, m->double_accesses);
+        addMetrics(&params->metrics, m);
+        params->sector_misses += range->sector_misses;
+        params->fetched_bytes += range->fetched_bytes;
+    }
+    //the lines dirty at the end of the trace are those of the last range
+    params->metrics.dirty_active = jobs[num_ranges - 1].params.metrics.dirty_active;
+    free(jobs);
+    return result;
+}
+
+//report written by --report, one name and value per field. JSON reports
+//are a flat object, CSV reports a name,value row per field, so both
+//carry the same names.
+typedef struct
+{
+    FILE* fp;
+    int csv;
+    int fields; //written so far
+} report_t;
+
+//reportName - starts a field, value follows
+void
+reportName(
+    report_t* report,
+    const char* name
+) {
+    if (report->csv) {
+        fprintf(report->fp, "%s,", name);
+    } else {
+        fprintf(report->fp, "%s\n  \"%s\": ", report->fields ? "," : "", name);
+    }
+    report->fields++;
+}
+
+void
+reportInteger(
+    report_t* report,
+    const char* name,
+    long long value
+) {
+    reportName(report, name);
+    fprintf(report->fp, report->csv ? "%lld\n" : "%lld", value);
+}
 
-    while (fscanf(tmp, " %c %llx,%d\n", &action, &memaddr, &size) == 3)
-    {
-        metrics_t metrics = {0};
-        params->counter++;
-        switch(action)
-        {
-        case 'I':
-            //printf("Skipping I\n");
-            // printCacheSets(fp, 'I', params->counter, memaddr, cache, params);
-            break; 
-        
-        case 'L':
-            // printCacheSets(fp, 'L', params->counter, memaddr, cache, params);
-            result = loadCache(cache, params, memaddr,&metrics); 
-            if (verbose) {
-               printMetrics('L',memaddr,size,&metrics);
-            }
-            addMetrics(&params->metrics, &metrics);
-            // printCacheSets(fp, 'L', params->counter, memaddr, cache, params);
-            break; 
+void
+reportReal(
+    report_t* report,
+    const char* name,
+    double value
+) {
+    reportName(report, name);
+    fprintf(report->fp, report->csv ? "%.9g\n" : "%.9g", value);
+}
 
-        case 'S':
-            // printCacheSets(fp, 'S', params->counter, memaddr, cache, params);
-            result = updateCache(cache, params, memaddr, &metrics);
-            if (verbose) {
-               printMetrics('S',memaddr,size,&metrics);
-            }
-            addMetrics(&params->metrics, &metrics);
-            // printCacheSets(fp, 'S', params->counter, memaddr, cache, params);
-            break; 
-        
-        case 'M':
-            // printCacheSets(fp, 'M', params->counter, memaddr, cache, params);
-            result = loadCache(cache, params, memaddr, &metrics);
-            if (result != 0) { 
-               printf("Error - loadCache failed\n");
-               return result;
+//reportString - quoted, with the escapes of JSON or CSV
+void
+reportString(
+    report_t* report,
+    const char* name,
+    const char* value
+) {
+    reportName(report, name);
+    fputc('"', report->fp);
+    for (const char* c = value; *c != '\0'; c++) {
+        if (report->csv) {
+            if (*c == '"') {
+                fputc('"', report->fp);
             }
-            result = updateCache(cache, params, memaddr, &metrics); 
-            if (verbose) {
-               printMetrics('M',memaddr,size,&metrics);
+            fputc(*c, report->fp);
+        } else if (*c == '"' || *c == '\\') {
+            fprintf(report->fp, "\\%c", *c);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(report->fp, "\\u%04x", *c);
+        } else {
+            fputc(*c, report->fp);
+        }
+    }
+    fputs(report->csv ? "\"\n" : "\"", report->fp);
+}
+
+//reportMetrics - the counts of printSummary, each name after prefix
+void
+reportMetrics(
+    report_t* report,
+    const char* prefix,
+    metrics_t* metrics
+) {
+    const char* names[] = {"hits", "misses", "evictions", "dirty_bytes_evicted",
+                           "dirty_bytes_active", "double_refs"};
+    long long values[] = {metrics->hitcount, metrics->misscount, metrics->evictcount,
+                          metrics->dirty_evicted, metrics->dirty_active,
+                          metrics->double_accesses};
+    char name[64];
+
+    for (int i = 0; i < 6; i++) {
+        snprintf(name, sizeof(name), "%s%s", prefix, names[i]);
+        reportInteger(report, name, values[i]);
+    }
+}
+
+//reportFeatures - the stats lines main prints after the summary, for
+//every feature the run had enabled
+void
+reportFeatures(
+    report_t* report,
+    param_t* params
+) {
+    char name[64];
+
+    if (params->sample_sets || params->window) {
+        const char* names[] = {"hits", "misses", "evictions", "dirty_bytes_evicted",
+                               "dirty_bytes_active", "double_refs"};
+        long long errors[] = {params->error.hitcount, params->error.misscount,
+                              params->error.evictcount, params->error.dirty_evicted,
+                              params->error.dirty_active, params->error.double_accesses};
+        reportInteger(report, "sampling.units", params->sampled);
+        reportReal(report, "sampling.confidence", params->confidence);
+        //half widths the sampled units cannot give are left out
+        for (int i = 0; i < 6; i++) {
+            if (errors[i] >= 0) {
+                snprintf(name, sizeof(name), "sampling.%s.error", names[i]);
+                reportInteger(report, name, errors[i]);
             }
-            addMetrics(&params->metrics, &metrics);
-            // printCacheSets(fp, 'M', params->counter, memaddr, cache, params);
-            break; 
-        
-        default: 
-            break; 
         }
-        if (result != 0)  {
-           break;
+    }
+    if (params->prefetch.kind != PREFETCH_NONE) {
+        prefetch_stats_t* stats = &params->prefetch.stats;
+        reportInteger(report, "prefetch.issued", stats->issued);
+        reportInteger(report, "prefetch.used", stats->used);
+        reportInteger(report, "prefetch.late", stats->late);
+        reportInteger(report, "prefetch.evictions", stats->evictions);
+        reportInteger(report, "prefetch.pollution", stats->pollution);
+        reportInteger(report, "prefetch.writeback_bytes", stats->writeback_bytes);
+    }
+    if (params->writes.enabled) {
+        reportInteger(report, "writes.memory_write_bytes", params->writes.memory_bytes);
+        reportInteger(report, "writes.memory_writes", params->writes.memory_writes);
+        reportInteger(report, "writes.coalesced", params->writes.coalesced);
+        reportInteger(report, "writes.victim_hits", params->writes.victim_hits);
+    }
+    for (int i = 0; i < params->num_traces; i++) {
+        snprintf(name, sizeof(name), "trace.%d.name", i);
+        reportString(report, name, params->traces[i]);
+        snprintf(name, sizeof(name), "trace.%d.", i);
+        reportMetrics(report, name, &params->trace_metrics[i]);
+        snprintf(name, sizeof(name), "trace.%d.evicted_by_others", i);
+        reportInteger(report, name, params->evicted_by_others[i]);
+    }
+    if (params->icache_geometry.E) {
+        reportMetrics(report, "icache.", &params->icache_metrics);
+    }
+    if (params->l2_geometry.E) {
+        reportMetrics(report, "l2.", &params->l2_metrics);
+    }
+    if (params->sectors) {
+        reportInteger(report, "sectors.sector_misses", params->sector_misses);
+        reportInteger(report, "sectors.fetched_bytes", params->fetched_bytes);
+    }
+    if (params->tlb.enabled) {
+        tlb_t* tlb = &params->tlb;
+        reportInteger(report, "tlb.l1_hits", tlb->l1.hits);
+        reportInteger(report, "tlb.l1_misses", tlb->l1.misses);
+        reportInteger(report, "tlb.l2_hits", tlb->l2.hits);
+        reportInteger(report, "tlb.l2_misses", tlb->l2.misses);
+        reportInteger(report, "tlb.walks", tlb->walks);
+        reportInteger(report, "tlb.walk_refs", tlb->walk_refs);
+        reportInteger(report, "tlb.pwc_hits", tlb->pwc.hits);
+        reportInteger(report, "tlb.walk_cycles", tlb->walk_cycles);
+    }
+    if (params->timing.enabled) {
+        unsigned long long stall;
+        double cycles_per_ref;
+        double amat;
+        timingSummary(params, &stall, &cycles_per_ref, &amat);
+        reportInteger(report, "timing.cycles", params->timing.clock);
+        reportInteger(report, "timing.stall_cycles", stall);
+        reportReal(report, "timing.cycles_per_ref", cycles_per_ref);
+        reportReal(report, "timing.amat", amat);
+    }
+    for (int i = 0; i < params->num_range_rows; i++) {
+        range_row_t* row = &params->range_rows[i];
+        snprintf(name, sizeof(name), "range.%d.start", i);
+        reportInteger(report, name, row->start);
+        snprintf(name, sizeof(name), "range.%d.end", i);
+        reportInteger(report, name, row->end);
+        if (row->error != 0) {
+            snprintf(name, sizeof(name), "range.%d.error", i);
+            reportInteger(report, name, row->error);
+            continue;
         }
+        snprintf(name, sizeof(name), "range.%d.", i);
+        reportMetrics(report, name, &row->metrics);
     }
-    
-    fclose(tmp);
+}
 
-    // Used for debugging
-    // 
-    // if (fp != NULL) {
-    //     fclose(fp);
-    // }
+#ifdef CSIM_PROFILE
+//reportProfile - phases in cycles and seconds, the access cost histogram
+//by the lower bound of its buckets and the set walk lengths, both
+//without empty buckets
+void
+reportProfile(
+    report_t* report,
+    double seconds
+) {
+    char name[64];
+    double cycles_per_second;
 
-    return result;
+    profileMerge();
+    cycles_per_second = seconds > 0
+        ? (readCycles() - profile_start_cycles) / seconds : 0;
+    reportReal(report, "profile.cycles_per_second", cycles_per_second);
+    for (int i = 0; i < NUM_PHASES; i++) {
+        snprintf(name, sizeof(name), "profile.phase.%s.cycles", phase_names[i]);
+        reportInteger(report, name, profile_total.phase_cycles[i]);
+        snprintf(name, sizeof(name), "profile.phase.%s.seconds", phase_names[i]);
+        reportReal(report, name, cycles_per_second > 0
+                   ? profile_total.phase_cycles[i] / cycles_per_second : 0);
+    }
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        if (profile_total.access_cycles[i]) {
+            snprintf(name, sizeof(name), "profile.access_cycles.%llu", 1ULL << i);
+            reportInteger(report, name, profile_total.access_cycles[i]);
+        }
+    }
+    for (int i = 0; i <= PROFILE_MAX_WALK; i++) {
+        if (profile_total.set_walk[i]) {
+            snprintf(name, sizeof(name), "profile.set_walk.%d", i);
+            reportInteger(report, name, profile_total.set_walk[i]);
+        }
+    }
+}
+#endif
+
+//writeReport - the results of the run to path, CSV if it ends in .csv
+//and JSON otherwise. Profile builds add their measurements.
+int
+writeReport(
+    char* path,
+    char* trace_name,
+    param_t* params,
+    double seconds
+) {
+    report_t report = {0};
+    char config[4096];
+    size_t len = strlen(path);
+    metrics_t* metrics = &params->metrics;
+    estimate_t counts = {metrics->hitcount, metrics->misscount, metrics->evictcount,
+                         metrics->dirty_evicted, metrics->dirty_active,
+                         metrics->double_accesses};
+
+    //sampled runs report their estimates in full
+    if (params->sample_sets || params->window) {
+        counts = params->estimate;
+    }
+
+    report.csv = len >= 4 && strcasecmp(path + len - 4, ".csv") == 0;
+    report.fp = fopen(path, "w");
+    if (report.fp == NULL) {
+        printf("Error: failed to open report - %s\n", path);
+        return ERROR_OPEN_FILE;
+    }
+    describeConfig(params, config, sizeof(config));
+    describeOptions(params, config, sizeof(config));
+    if (report.csv) {
+        fprintf(report.fp, "name,value\n");
+    } else {
+        fprintf(report.fp, "{");
+    }
+    reportString(&report, "version", CSIM_VERSION);
+    reportString(&report, "trace", trace_name);
+    reportString(&report, "config", config);
+    reportInteger(&report, "hits", counts.hitcount);
+    reportInteger(&report, "misses", counts.misscount);
+    reportInteger(&report, "evictions", counts.evictcount);
+    reportInteger(&report, "dirty_bytes_evicted", counts.dirty_evicted);
+    reportInteger(&report, "dirty_bytes_active", counts.dirty_active);
+    reportInteger(&report, "double_refs", counts.double_accesses);
+    reportFeatures(&report, params);
+    reportReal(&report, "wall_seconds", seconds);
+#ifdef CSIM_PROFILE
+    reportProfile(&report, seconds);
+#endif
+    if (!report.csv) {
+        fprintf(report.fp, "\n}\n");
+    }
+    if (fclose(report.fp) != 0) {
+        printf("Error: failed to write report - %s\n", path);
+        return ERROR_OPEN_FILE;
+    }
+    return 0;
+}
+
+//in-process simulator, see csim.h. Runs every access through
+//simulateRecord() like a trace record, the params are those of a run
+//without options.
+struct csim
+{
+    param_t params;
+    cache_t cache;
+};
+
+csim_t*
+csimCreate(
+    int s,
+    int E,
+    int b
+) {
+    csim_t* sim;
+
+    if (s < 0 || b < 0 || E < 1 || s + b >= MEMADDR_BITSIZE) {
+        return NULL;
+    }
+    sim = calloc(1, sizeof(csim_t));
+    if (sim == NULL) {
+        return NULL;
+    }
+    sim->params.s = s;
+    sim->params.E = E;
+    sim->params.b = b;
+    sim->params.S = pow(2.0, s);
+    sim->params.B = pow(2.0, b);
+    sim->params.t = 64 - s - b;
+    if (init(&sim->params, &sim->cache) != 0) {
+        free(sim);
+        return NULL;
+    }
+    return sim;
+}
+
+int
+csimAccess(
+    csim_t* sim,
+    char action,
+    unsigned long long address,
+    int size
+) {
+    metrics_t metrics = {0};
+
+    sim->params.counter++;
+    return simulateRecord(&sim->cache, &sim->params, action, address, size, &metrics);
+}
+
+void
+csimResults(
+    csim_t* sim,
+    csim_results_t* results
+) {
+    metrics_t* metrics = &sim->params.metrics;
+
+    flushFilter(&sim->params); //hits of the current run are not counted yet
+    results->hits = metrics->hitcount;
+    results->misses = metrics->misscount;
+    results->evictions = metrics->evictcount;
+    results->dirty_evicted = metrics->dirty_evicted;
+    results->dirty_active = metrics->dirty_active;
+    results->double_refs = metrics->double_accesses;
+}
+
+int
+csimReset(
+    csim_t* sim
+) {
+    metrics_t metrics = {0};
+    filter_t filter = {0};
+
+    //tools reset once per candidate, so the arena is kept and cleared
+    memset(sim->cache.lines, 0,
+           sizeof(cache_line_t) * (size_t) sim->params.S * sim->params.E);
+    sim->cache.materialized = 0;
+    for (long long i = 0; i < sim->params.S; i++) {
+        materializeSet(&sim->cache, &sim->params, i);
+    }
+    sim->params.metrics = metrics;
+    sim->params.filter = filter;
+    sim->params.counter = 0;
+    return 0;
+}
+
+void
+csimFree(
+    csim_t* sim
+) {
+    if (sim != NULL) {
+        free_cache(&sim->cache);
+        free(sim);
+    }
 }
 
+#ifndef CSIM_LIBRARY
 int
 main(
     int argc,
@@ -533,12 +5299,357 @@ main(
     cache_t current_cache = {0};
     param_t cache_param = {0}; 
     char* trace_file = NULL; 
-    char input; 
-    
-    while((input = getopt(argc, argv, "s:E:b:t:vh")) != -1)
+    char* manifest = NULL;
+    char* cat = NULL; //--cat way masks, parsed once E and --traces are known
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int trace_index = 0; //print the trace index and exit
+    int num_ranges = 0; //--ranges, 0 for one run over the trace or range
+    char* report = NULL; //--report file
+    struct timespec start;
+    int input; 
+    struct option long_options[] = {
+        {"compact", no_argument, &cache_param.compact, 1},
+        {"lazy", no_argument, &cache_param.lazy, 1},
+        {"batch", required_argument, NULL, OPT_BATCH},
+        {"threads", required_argument, NULL, OPT_THREADS},
+        {"result-cache", required_argument, NULL, OPT_RESULT_CACHE},
+        {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+        {"checkpoint-every", required_argument, NULL, OPT_CHECKPOINT_EVERY},
+        {"resume", required_argument, NULL, OPT_RESUME},
+        {"warm", required_argument, NULL, OPT_WARM},
+        {"count", required_argument, NULL, OPT_COUNT},
+        {"sample-sets", required_argument, NULL, OPT_SAMPLE_SETS},
+        {"sample-intervals", required_argument, NULL, OPT_SAMPLE_INTERVALS},
+        {"confidence", required_argument, NULL, OPT_CONFIDENCE},
+        {"prefetch", required_argument, NULL, OPT_PREFETCH},
+        {"prefetch-degree", required_argument, NULL, OPT_PREFETCH_DEGREE},
+        {"prefetch-latency", required_argument, NULL, OPT_PREFETCH_LATENCY},
+        {"stream-buffers", required_argument, NULL, OPT_STREAM_BUFFERS},
+        {"write-through", no_argument, NULL, OPT_WRITE_THROUGH},
+        {"no-write-allocate", no_argument, NULL, OPT_NO_WRITE_ALLOCATE},
+        {"write-buffer", required_argument, NULL, OPT_WRITE_BUFFER},
+        {"victim-cache", required_argument, NULL, OPT_VICTIM_CACHE},
+        {"hit-latency", required_argument, NULL, OPT_HIT_LATENCY},
+        {"miss-penalty", required_argument, NULL, OPT_MISS_PENALTY},
+        {"bandwidth", required_argument, NULL, OPT_BANDWIDTH},
+        {"mshrs", required_argument, NULL, OPT_MSHRS},
+        {"victim-latency", required_argument, NULL, OPT_VICTIM_LATENCY},
+        {"tlb", required_argument, NULL, OPT_TLB},
+        {"page-size", required_argument, NULL, OPT_PAGE_SIZE},
+        {"walk-latency", required_argument, NULL, OPT_WALK_LATENCY},
+        {"tlb-l2-latency", required_argument, NULL, OPT_TLB_L2_LATENCY},
+        {"pwc", required_argument, NULL, OPT_PWC},
+        {"split-accesses", no_argument, NULL, OPT_SPLIT_ACCESSES},
+        {"sectors", required_argument, NULL, OPT_SECTORS},
+        {"index", required_argument, NULL, OPT_INDEX},
+        {"sets", required_argument, NULL, OPT_SETS},
+        {"icache", required_argument, NULL, OPT_ICACHE},
+        {"l2", required_argument, NULL, OPT_L2},
+        {"l2-latency", required_argument, NULL, OPT_L2_LATENCY},
+        {"traces", required_argument, NULL, OPT_TRACES},
+        {"quantum", required_argument, NULL, OPT_QUANTUM},
+        {"cat", required_argument, NULL, OPT_CAT},
+        {"journal", required_argument, NULL, OPT_JOURNAL},
+        {"keyframe-every", required_argument, NULL, OPT_KEYFRAME_EVERY},
+        {"trace-index", no_argument, NULL, OPT_TRACE_INDEX},
+        {"trace-index-every", required_argument, NULL, OPT_TRACE_INDEX_EVERY},
+        {"range", required_argument, NULL, OPT_RANGE},
+        {"range-warmup", required_argument, NULL, OPT_RANGE_WARMUP},
+        {"ranges", required_argument, NULL, OPT_RANGES},
+        {"report", required_argument, NULL, OPT_REPORT},
+        {0, 0, 0, 0}
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    PROFILE_INIT();
+    while((input = getopt_long(argc, argv, "s:E:b:t:vh", long_options, NULL)) != -1)
     {
         switch(input)
         {
+        case 0: //long option that only sets a flag
+            break;
+
+        case OPT_BATCH:
+            manifest = optarg;
+            break;
+
+        case OPT_THREADS:
+            num_threads = atoi(optarg);
+            break;
+
+        case OPT_RESULT_CACHE:
+            cache_param.result_cache = optarg;
+            break;
+
+        case OPT_CHECKPOINT:
+            cache_param.checkpoint = optarg;
+            break;
+
+        case OPT_CHECKPOINT_EVERY:
+            cache_param.checkpoint_every = atoll(optarg);
+            break;
+
+        case OPT_RESUME:
+            cache_param.restore = optarg;
+            cache_param.warm = 0;
+            break;
+
+        case OPT_WARM:
+            cache_param.restore = optarg;
+            cache_param.warm = 1;
+            break;
+
+        case OPT_COUNT:
+            cache_param.max_records = atoll(optarg);
+            break;
+
+        case OPT_SAMPLE_SETS:
+            cache_param.sample_sets = atoi(optarg);
+            break;
+
+        case OPT_SAMPLE_INTERVALS:
+            if (sscanf(optarg, "%lld:all:%lld", &cache_param.window,
+                       &cache_param.period) == 2) {
+                if (cache_param.window < 1 || cache_param.period < cache_param.window) {
+                    printf("Error: --sample-intervals needs u:all:p with 1 <= u <= p\n");
+                    exit(ERROR_BAD_OPTION);
+                }
+                cache_param.warmup = -1;
+            } else if (sscanf(optarg, "%lld:%lld:%lld", &cache_param.window,
+                              &cache_param.warmup, &cache_param.period) != 3
+                       || cache_param.window < 1 || cache_param.warmup < 0
+                       || cache_param.period < cache_param.window + cache_param.warmup) {
+                printf("Error: --sample-intervals needs u:w:p with u+w <= p\n");
+                exit(ERROR_BAD_OPTION);
+            }
+            break;
+
+        case OPT_CONFIDENCE:
+            cache_param.confidence = atof(optarg);
+            break;
+
+        case OPT_PREFETCH:
+            cache_param.prefetch.kind = -1;
+            for (int i = 0; i <= PREFETCH_AMPM; i++) {
+                if (strcmp(optarg, prefetch_names[i]) == 0) {
+                    cache_param.prefetch.kind = i;
+                }
+            }
+            if (cache_param.prefetch.kind < 0) {
+                printf("Error: unknown prefetcher - %s\n", optarg);
+                exit(ERROR_BAD_OPTION);
+            }
+            break;
+
+        case OPT_PREFETCH_DEGREE:
+            cache_param.prefetch.degree = atoi(optarg);
+            break;
+
+        case OPT_PREFETCH_LATENCY:
+            cache_param.prefetch.latency = atoi(optarg);
+            break;
+
+        case OPT_STREAM_BUFFERS:
+            cache_param.prefetch.num_buffers = atoi(optarg);
+            break;
+
+        case OPT_WRITE_THROUGH:
+            cache_param.writes.write_through = 1;
+            break;
+
+        case OPT_NO_WRITE_ALLOCATE:
+            cache_param.writes.no_write_allocate = 1;
+            break;
+
+        case OPT_WRITE_BUFFER:
+            cache_param.writes.buffer_entries = atoi(optarg);
+            break;
+
+        case OPT_VICTIM_CACHE:
+            cache_param.writes.victim_lines = atoi(optarg);
+            break;
+
+        case OPT_HIT_LATENCY:
+            cache_param.timing.hit_latency = atoi(optarg);
+            cache_param.timing.enabled = 1;
+            break;
+
+        case OPT_MISS_PENALTY:
+            cache_param.timing.miss_penalty = atoi(optarg);
+            cache_param.timing.enabled = 1;
+            break;
+
+        case OPT_BANDWIDTH:
+            cache_param.timing.bandwidth = atoi(optarg);
+            cache_param.timing.enabled = 1;
+            break;
+
+        case OPT_MSHRS:
+            cache_param.timing.mshrs = atoi(optarg);
+            cache_param.timing.enabled = 1;
+            break;
+
+        case OPT_VICTIM_LATENCY:
+            cache_param.timing.victim_latency = atoi(optarg);
+            cache_param.timing.enabled = 1;
+            break;
+
+        case OPT_TLB:
+            cache_param.tlb.l2.entries = 0;
+            if (sscanf(optarg, "%d:%d:%d:%d",
+                       &cache_param.tlb.l1.entries, &cache_param.tlb.l1.ways,
+                       &cache_param.tlb.l2.entries, &cache_param.tlb.l2.ways) < 2
+                    || cache_param.tlb.l1.entries <= 0) {
+                printf("Error: bad --tlb - %s\n", optarg);
+                exit(ERROR_BAD_OPTION);
+            }
+            cache_param.tlb.enabled = 1;
+            break;
+
+        case OPT_PAGE_SIZE:
+            if (strcasecmp(optarg, "4K") == 0) {
+                cache_param.tlb.page_bits = 12;
+            } else if (strcasecmp(optarg, "2M") == 0) {
+                cache_param.tlb.page_bits = 21;
+            } else if (strcasecmp(optarg, "1G") == 0) {
+                cache_param.tlb.page_bits = 30;
+            } else {
+                printf("Error: page size must be 4K, 2M or 1G - %s\n", optarg);
+                exit(ERROR_BAD_OPTION);
+            }
+            cache_param.tlb.enabled = 1;
+            break;
+
+        case OPT_WALK_LATENCY:
+            cache_param.tlb.walk_latency = atoi(optarg);
+            cache_param.tlb.enabled = 1;
+            break;
+
+        case OPT_TLB_L2_LATENCY:
+            cache_param.tlb.l2_latency = atoi(optarg);
+            cache_param.tlb.enabled = 1;
+            break;
+
+        case OPT_PWC:
+            cache_param.tlb.pwc.entries = atoi(optarg);
+            cache_param.tlb.enabled = 1;
+            break;
+
+        case OPT_SPLIT_ACCESSES:
+            cache_param.split_accesses = 1;
+            break;
+
+        case OPT_SECTORS:
+            cache_param.sectors = atoi(optarg);
+            break;
+
+        case OPT_INDEX:
+            cache_param.index_kind = -1;
+            for (int i = 0; i <= INDEX_SKEW; i++) {
+                if (strcmp(optarg, index_names[i]) == 0) {
+                    cache_param.index_kind = i;
+                }
+            }
+            if (cache_param.index_kind < 0) {
+                printf("Error: unknown index function - %s\n", optarg);
+                exit(ERROR_BAD_OPTION);
+            }
+            break;
+
+        case OPT_ICACHE:
+        case OPT_L2: {
+            geometry_t* geometry = input == OPT_ICACHE ? &cache_param.icache_geometry
+                                                     : &cache_param.l2_geometry;
+            if (sscanf(optarg, "%d:%d:%d", &geometry->s, &geometry->E, &geometry->b) != 3
+                    || geometry->s < 0 || geometry->E <= 0 || geometry->b < 0
+                    || geometry->s + geometry->b > 62) {
+                printf("Error: bad cache geometry, expected <s>:<E>:<b> - %s\n", optarg);
+                exit(ERROR_BAD_OPTION);
+            }
+            break;
+        }
+
+        case OPT_L2_LATENCY:
+            cache_param.timing.l2_latency = atoi(optarg);
+            cache_param.timing.enabled = 1;
+            break;
+
+        case OPT_TRACES:
+            cache_param.num_traces = 1;
+            for (char* c = optarg; *c != '\0'; c++) {
+                cache_param.num_traces += (*c == ',');
+            }
+            cache_param.traces = calloc(cache_param.num_traces, sizeof(char*));
+            cache_param.trace_metrics = calloc(cache_param.num_traces, sizeof(metrics_t));
+            cache_param.evicted_by_others = calloc(cache_param.num_traces, sizeof(long long));
+            if (cache_param.traces == NULL || cache_param.trace_metrics == NULL
+                    || cache_param.evicted_by_others == NULL) {
+                exit(ERROR_INIT_CACHE);
+            }
+            for (int i = 0; i < cache_param.num_traces; i++) {
+                cache_param.traces[i] = strtok(i == 0 ? optarg : NULL, ",");
+                if (cache_param.traces[i] == NULL) {
+                    printf("Error: empty trace name in --traces\n");
+                    exit(ERROR_BAD_OPTION);
+                }
+            }
+            break;
+
+        case OPT_QUANTUM:
+            cache_param.quantum = atoll(optarg);
+            break;
+
+        case OPT_CAT:
+            cat = optarg;
+            break;
+
+        case OPT_JOURNAL:
+            cache_param.journal_path = optarg;
+            break;
+
+        case OPT_KEYFRAME_EVERY:
+            cache_param.keyframe_every = atoll(optarg);
+            break;
+
+        case OPT_TRACE_INDEX:
+            trace_index = 1;
+            break;
+
+        case OPT_TRACE_INDEX_EVERY:
+            cache_param.index_every = atoll(optarg);
+            break;
+
+        case OPT_RANGE:
+            if (sscanf(optarg, "%lld:%lld", &cache_param.range_start,
+                       &cache_param.range_end) < 1
+                    || cache_param.range_start < 0 || cache_param.range_end < 0
+                    || (cache_param.range_end
+                        && cache_param.range_end <= cache_param.range_start)) {
+                printf("Error: --range needs <start>:<end> with start < end - %s\n", optarg);
+                exit(ERROR_BAD_OPTION);
+            }
+            break;
+
+        case OPT_RANGE_WARMUP:
+            cache_param.range_warmup = atoll(optarg);
+            break;
+
+        case OPT_RANGES:
+            num_ranges = atoi(optarg);
+            break;
+
+        case OPT_REPORT:
+            report = optarg;
+            break;
+
+        case OPT_SETS:
+            cache_param.num_sets = atoll(optarg);
+            if (cache_param.num_sets <= 0) {
+                printf("Error: --sets must be positive - %s\n", optarg);
+                exit(ERROR_BAD_OPTION);
+            }
+            break;
+
         case 's': //number of cache sets
             cache_param.s = atoi(optarg);
             break; 
@@ -569,30 +5680,293 @@ main(
         }
     }
 
-    if (trace_file == NULL) {
+    if (cache_param.result_cache == NULL) {
+        cache_param.result_cache = getenv(RESULT_CACHE_ENV);
+    }
+    if (cache_param.result_cache != NULL && cache_param.result_cache[0] != '\0') {
+        mkdir(cache_param.result_cache, 0777); //fine if it exists
+    } else {
+        cache_param.result_cache = NULL;
+    }
+
+    if (cache_param.confidence <= 0 || cache_param.confidence >= 1) {
+        cache_param.confidence = 0.95;
+    }
+    if ((cache_param.sample_sets || cache_param.window)
+            && (cache_param.checkpoint != NULL || cache_param.restore != NULL)) {
+        //snapshots do not hold the per unit metrics
+        printf("Error: sampling cannot be combined with snapshots\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.sample_sets < 0) {
+        cache_param.sample_sets = 0;
+    }
+    if (cache_param.prefetch.degree < 1) {
+        cache_param.prefetch.degree = 2;
+    }
+    if (cache_param.prefetch.latency <= 0) {
+        cache_param.prefetch.latency = 10;
+    }
+    if (cache_param.prefetch.num_buffers < 1) {
+        cache_param.prefetch.num_buffers = 4;
+    }
+    if (cache_param.prefetch.kind != PREFETCH_NONE
+            && (cache_param.compact || cache_param.checkpoint != NULL
+                || cache_param.restore != NULL)) {
+        //compact lines have no prefetch bits, snapshots no prefetcher state
+        printf("Error: --prefetch cannot be combined with --compact or snapshots\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.writes.buffer_entries < 0) {
+        cache_param.writes.buffer_entries = 0;
+    }
+    if (cache_param.writes.victim_lines < 0) {
+        cache_param.writes.victim_lines = 0;
+    }
+    cache_param.writes.enabled = cache_param.writes.write_through
+        || cache_param.writes.no_write_allocate
+        || cache_param.writes.buffer_entries || cache_param.writes.victim_lines;
+    if (cache_param.writes.enabled
+            && (cache_param.compact || cache_param.checkpoint != NULL
+                || cache_param.restore != NULL)) {
+        //the write buffer and victim cache are not part of a snapshot
+        printf("Error: write policy options cannot be combined with --compact or snapshots\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.timing.hit_latency <= 0) {
+        cache_param.timing.hit_latency = 1;
+    }
+    if (cache_param.timing.miss_penalty <= 0) {
+        cache_param.timing.miss_penalty = 100;
+    }
+    if (cache_param.timing.victim_latency <= 0) {
+        cache_param.timing.victim_latency = 1;
+    }
+    if (cache_param.timing.mshrs < 0) {
+        cache_param.timing.mshrs = 0;
+    }
+    if (cache_param.tlb.l1.entries == 0) {
+        cache_param.tlb.l1.entries = 64;
+        cache_param.tlb.l1.ways = 4;
+        cache_param.tlb.l2.entries = 1536;
+        cache_param.tlb.l2.ways = 12;
+    }
+    if (cache_param.tlb.page_bits == 0) {
+        cache_param.tlb.page_bits = PAGE_BITS_4K;
+    }
+    if (cache_param.tlb.walk_latency <= 0) {
+        cache_param.tlb.walk_latency = 20;
+    }
+    if (cache_param.tlb.l2_latency <= 0) {
+        cache_param.tlb.l2_latency = 7;
+    }
+    cache_param.tlb.pwc.ways = 0; //fully associative
+    if (cache_param.tlb.enabled
+            && (cache_param.sample_sets || cache_param.window
+                || cache_param.checkpoint != NULL || cache_param.restore != NULL)) {
+        //set sampling skips records, snapshots do not hold TLB state
+        printf("Error: TLB options cannot be combined with sampling or snapshots\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.timing.enabled
+            && (cache_param.sample_sets || cache_param.window
+                || cache_param.checkpoint != NULL || cache_param.restore != NULL)) {
+        //the timeline needs every reference, from the start of the trace
+        printf("Error: latency options cannot be combined with sampling or snapshots\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.sectors < 0) {
+        cache_param.sectors = 0;
+    }
+    if (cache_param.sectors) {
+        int n = 0;
+        while ((1 << n) < cache_param.sectors) {
+            n++;
+        }
+        if ((1 << n) != cache_param.sectors || n > cache_param.b || n > 6) {
+            printf("Error: --sectors must be a power of two, at most 64 and at most 2^b\n");
+            exit(ERROR_BAD_OPTION);
+        }
+        cache_param.sector_bits = cache_param.b - n;
+        if (cache_param.compact || cache_param.prefetch.kind != PREFETCH_NONE
+                || cache_param.writes.enabled || cache_param.checkpoint != NULL
+                || cache_param.restore != NULL) {
+            //sector bits live in cache_line_t only, snapshots do not hold them
+            printf("Error: --sectors cannot be combined with --compact, --prefetch, "
+                   "write policy options or snapshots\n");
+            exit(ERROR_BAD_OPTION);
+        }
+    }
+    if (cache_param.num_sets && cache_param.num_sets == (1LL << cache_param.s)) {
+        cache_param.num_sets = 0; //plain bit selection
+    }
+    cache_param.hashed = cache_param.index_kind != INDEX_MODULO
+        || cache_param.num_sets != 0;
+    if (cache_param.hashed
+            && (cache_param.compact || cache_param.prefetch.kind != PREFETCH_NONE
+                || cache_param.writes.enabled || cache_param.sectors
+                || cache_param.sample_sets || cache_param.checkpoint != NULL
+                || cache_param.restore != NULL)) {
+        //all of these take the set index from the address bits
+        printf("Error: --index and --sets cannot be combined with --compact, --prefetch, "
+               "write policy options, --sectors, set sampling or snapshots\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.timing.l2_latency <= 0) {
+        cache_param.timing.l2_latency = 10;
+    }
+    if ((cache_param.icache_geometry.E || cache_param.l2_geometry.E)
+            && (cache_param.compact || cache_param.prefetch.kind != PREFETCH_NONE
+                || cache_param.writes.enabled || cache_param.sectors || cache_param.hashed
+                || cache_param.sample_sets || cache_param.window
+                || cache_param.checkpoint != NULL || cache_param.restore != NULL)) {
+        //the L2 relies on loadCache/updateCache choosing the victim, and
+        //neither sampling nor snapshots cover the other levels
+        printf("Error: --icache and --l2 cannot be combined with --compact, --prefetch, "
+               "write policy options, --sectors, --index, sampling or snapshots\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.quantum <= 0) {
+        cache_param.quantum = 1000;
+    }
+    if (cat != NULL) {
+        char* c = cat;
+        if (cache_param.num_traces == 0) {
+            printf("Error: --cat needs --traces\n");
+            exit(ERROR_BAD_OPTION);
+        }
+        if (cache_param.E > 64) {
+            printf("Error: --cat way masks cover at most 64 ways\n");
+            exit(ERROR_BAD_OPTION);
+        }
+        cache_param.way_masks = calloc(cache_param.num_traces, sizeof(unsigned long long));
+        if (cache_param.way_masks == NULL) {
+            exit(ERROR_INIT_CACHE);
+        }
+        for (int i = 0; i < cache_param.num_traces; i++) {
+            char* end;
+            unsigned long long ways = cache_param.E == 64 ? ~0ULL : (1ULL << cache_param.E) - 1;
+            cache_param.way_masks[i] = strtoull(c, &end, 0) & ways;
+            if (end == c || cache_param.way_masks[i] == 0
+                    || (*end != (i + 1 < cache_param.num_traces ? ',' : '\0'))) {
+                printf("Error: --cat needs a non-empty way mask for each trace - %s\n", cat);
+                exit(ERROR_BAD_OPTION);
+            }
+            c = end + 1;
+        }
+    }
+    if (cache_param.num_traces
+            && (cache_param.compact || cache_param.prefetch.kind != PREFETCH_NONE
+                || cache_param.writes.enabled || cache_param.sectors || cache_param.hashed
+                || cache_param.icache_geometry.E || cache_param.l2_geometry.E
+                || cache_param.tlb.enabled || cache_param.sample_sets || cache_param.window
+                || cache_param.checkpoint != NULL || cache_param.restore != NULL
+                || manifest != NULL)) {
+        //lines of the other variants carry no address-space ID
+        printf("Error: --traces cannot be combined with --compact, --prefetch, "
+               "write policy options, --sectors, --index, --icache, --l2, --tlb, "
+               "sampling, snapshots or --batch\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.keyframe_every <= 0) {
+        cache_param.keyframe_every = 100000;
+    }
+    if (cache_param.journal_path != NULL
+            && (cache_param.compact || cache_param.prefetch.kind != PREFETCH_NONE
+                || cache_param.hashed || manifest != NULL)) {
+        //the journal follows the lines of the set an access maps to
+        printf("Error: --journal cannot be combined with --compact, --prefetch, "
+               "--index, --sets or --batch\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.journal_path != NULL && cache_param.E > JOURNAL_MAX_WAYS) {
+        printf("Error: --journal supports at most %d ways\n", JOURNAL_MAX_WAYS);
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.index_every <= 0) {
+        cache_param.index_every = 65536;
+    }
+    if (cache_param.range_warmup < 0) {
+        cache_param.range_warmup = 0;
+    }
+    if (num_ranges < 0) {
+        num_ranges = 0;
+    }
+    if ((cache_param.range_start || cache_param.range_end || num_ranges)
+            && (cache_param.prefetch.kind != PREFETCH_NONE || cache_param.writes.enabled
+                || cache_param.timing.enabled || cache_param.tlb.enabled
+                || cache_param.icache_geometry.E || cache_param.l2_geometry.E
+                || cache_param.num_traces || cache_param.sample_sets || cache_param.window
+                || cache_param.checkpoint != NULL || cache_param.restore != NULL
+                || cache_param.max_records || manifest != NULL)) {
+        //the counters of these would include the warm-up, and sampling,
+        //snapshots and --count choose records of their own
+        printf("Error: --range and --ranges cannot be combined with --prefetch, "
+               "write policy options, latency options, --tlb, --icache, --l2, "
+               "--traces, sampling, snapshots, --count or --batch\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (num_ranges && (cache_param.range_start || cache_param.range_end
+                       || cache_param.journal_path != NULL)) {
+        printf("Error: --ranges cannot be combined with --range or --journal\n");
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cache_param.checkpoint_every && cache_param.checkpoint == NULL) {
+        printf("Error: --checkpoint-every needs --checkpoint\n");
+        exit(-1);
+    }
+    if ((cache_param.checkpoint != NULL || cache_param.restore != NULL) && manifest != NULL) {
+        //every job would write the same checkpoint or restore the same state
+        printf("Error: --checkpoint, --resume and --warm cannot be combined with --batch\n");
+        exit(ERROR_BAD_OPTION);
+    }
+
+    if (report != NULL && (manifest != NULL || trace_index)) {
+        printf("Error: --report cannot be combined with --batch or --trace-index\n");
+        exit(ERROR_BAD_OPTION);
+    }
+
+    if (manifest != NULL) {
+        //rows from many jobs would be mixed up with per-access output
+        verbose = 0;
+        exit(runBatch(manifest, &cache_param, num_threads));
+    }
+
+    if (trace_file == NULL && cache_param.num_traces == 0) {
         printf("Error: no trace file specified.\n");
         printUsage();
         exit(-1);
     }
 
-    cache_param.S = pow(2.0, cache_param.s); //S = 2^s
-    cache_param.B = pow(2.0, cache_param.b); //B = 2^b
-    cache_param.t = 64 - cache_param.s - cache_param.b; 
-
-    result = init(
-                cache_param.S,
-                cache_param.E,
-                &current_cache); //initialize cache
-    if (result != 0) {
-        printf("Error: failed to initialize cache\n");
+    if (trace_index) {
+        trace_index_t index;
+        if (trace_file == NULL) {
+            printf("Error: --trace-index needs -t\n");
+            exit(ERROR_BAD_OPTION);
+        }
+        result = loadTraceIndex(trace_file, cache_param.index_every, &index);
+        if (result == 0) {
+            printTraceIndex(&index);
+            free(index.blocks);
+        }
         exit(result);
     }
-
-    result = parseTraceFile(trace_file, &cache_param, &current_cache); 
+    if (num_ranges) {
+        if (trace_file == NULL) {
+            printf("Error: --ranges needs -t\n");
+            exit(ERROR_BAD_OPTION);
+        }
+        //rows of the ranges would be mixed up with per-access output
+        verbose = 0;
+        result = runRanges(trace_file, &cache_param, num_ranges, num_threads);
+    } else {
+        result = simulateCached(trace_file, &cache_param, &current_cache);
+    }
     if (result != 0) {
         exit(result);
     }
 
+    PROFILE_START(report_start);
     printSummary(
         cache_param.metrics.hitcount,
         cache_param.metrics.misscount,
@@ -601,6 +5975,70 @@ main(
         cache_param.metrics.dirty_active,
         cache_param.metrics.double_accesses
         );
+    if (cache_param.sample_sets || cache_param.window) {
+        printSamplingError(&cache_param);
+    }
+    if (cache_param.prefetch.kind != PREFETCH_NONE) {
+        prefetch_stats_t* stats = &cache_param.prefetch.stats;
+        printf("prefetch %s: issued:%lld used:%lld late:%lld "
+               "evictions:%lld pollution:%lld writeback_bytes:%lld\n",
+               prefetch_names[cache_param.prefetch.kind], stats->issued,
+               stats->used, stats->late, stats->evictions, stats->pollution,
+               stats->writeback_bytes);
+    }
+    if (cache_param.writes.enabled) {
+        printf("writes: memory_write_bytes:%lld memory_writes:%lld "
+               "coalesced:%lld victim_hits:%lld\n",
+               cache_param.writes.memory_bytes, cache_param.writes.memory_writes,
+               cache_param.writes.coalesced, cache_param.writes.victim_hits);
+    }
+    for (int i = 0; i < cache_param.num_traces; i++) {
+        metrics_t* metrics = &cache_param.trace_metrics[i];
+        printf("%s: hits:%d misses:%d evictions:%d dirty_bytes_evicted:%d "
+               "dirty_bytes_active:%d double_refs:%d evicted_by_others:%lld\n",
+               cache_param.traces[i], metrics->hitcount, metrics->misscount,
+               metrics->evictcount, metrics->dirty_evicted, metrics->dirty_active,
+               metrics->double_accesses, cache_param.evicted_by_others[i]);
+    }
+    if (cache_param.icache_geometry.E) {
+        printLevel("icache", &cache_param.icache_metrics);
+    }
+    if (cache_param.l2_geometry.E) {
+        printLevel("l2", &cache_param.l2_metrics);
+    }
+    if (cache_param.sectors) {
+        printf("sectors: sector_misses:%lld fetched_bytes:%lld\n",
+               cache_param.sector_misses, cache_param.fetched_bytes);
+    }
+    if (cache_param.tlb.enabled) {
+        printTlb(&cache_param);
+    }
+    if (cache_param.timing.enabled) {
+        printTiming(&cache_param);
+    }
+    PROFILE_PHASE(PHASE_REPORT, report_start);
+    if (report != NULL) {
+        struct timespec end;
+        char trace_name[4096] = "";
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (trace_file != NULL) {
+            snprintf(trace_name, sizeof(trace_name), "%s", trace_file);
+        }
+        for (int i = 0; i < cache_param.num_traces; i++) {
+            size_t len = strlen(trace_name);
+            snprintf(trace_name + len, sizeof(trace_name) - len, "%s%s",
+                     i ? "," : "", cache_param.traces[i]);
+        }
+        result = writeReport(report, trace_name, &cache_param,
+                             (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
 
+    free_cache(&current_cache);
+    free(cache_param.traces);
+    free(cache_param.trace_metrics);
+    free(cache_param.evicted_by_others);
+    free(cache_param.way_masks);
+    free(cache_param.range_rows);
     return result;
 }
+#endif
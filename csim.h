@@ -0,0 +1,41 @@
+/*
+ * csim.h - in-process interface to the cache simulator of csim.c, for
+ * tools that generate their address stream themselves instead of
+ * reading a trace file. Link csim.c compiled with -DCSIM_LIBRARY, which
+ * leaves out csim's main().
+ *
+ * The simulated cache is the one of a csim run without options: LRU,
+ * write-back and write-allocate, s, E and b as on csim's command line.
+ */
+#ifndef CSIM_H
+#define CSIM_H
+
+typedef struct csim csim_t;
+
+typedef struct
+{
+    int hits;
+    int misses;
+    int evictions;
+    int dirty_evicted; //bytes
+    int dirty_active; //bytes
+    int double_refs;
+} csim_results_t;
+
+/* csimCreate - a cold cache of 2^s sets of E lines of 2^b bytes, NULL on
+ * a bad geometry or when out of memory */
+csim_t* csimCreate(int s, int E, int b);
+
+/* csimAccess - simulates one trace record, action is 'L', 'S', 'M' or
+ * 'I' like in a trace. Returns non-zero on an internal error. */
+int csimAccess(csim_t* sim, char action, unsigned long long address, int size);
+
+/* csimResults - counts of all accesses since creation or the last reset */
+void csimResults(csim_t* sim, csim_results_t* results);
+
+/* csimReset - empties the cache and zeroes the counts */
+int csimReset(csim_t* sim);
+
+void csimFree(csim_t* sim);
+
+#endif /* CSIM_H */
@@ -0,0 +1,64 @@
+/*
+ * journal.h - format of the binary event journal written by csim --journal
+ * and read by csim-journal.
+ *
+ * A journal is a journal_header_t, then journal_event_t records in the
+ * order they happened, then the keyframe index (num_keyframes
+ * journal_keyframe_t) and a journal_trailer_t at the very end.
+ *
+ * Events only describe changes of the L1 (data) cache lines. A keyframe
+ * is a JOURNAL_KEYFRAME event followed by one JOURNAL_FILL event per
+ * valid line, it holds the state after all records up to its record.
+ * The state after record r is the last keyframe at or before r plus the
+ * events after it with a record up to r.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC "CSIMJNL1"
+#define JOURNAL_TRAILER_MAGIC "CSIMJIDX"
+
+//event kinds
+#define JOURNAL_FILL 1 //tag now valid in set/way, dirty as given
+#define JOURNAL_EVICT 2 //tag left set/way, written back if dirty
+#define JOURNAL_DIRTY 3 //line of set/way became dirty (or clean)
+#define JOURNAL_KEYFRAME 4 //tag holds the number of FILL events that follow
+
+#define JOURNAL_MAX_WAYS 65536 //way of an event is 16 bits
+
+typedef struct
+{
+    char magic[8];
+    int32_t s;
+    int32_t E;
+    int32_t b;
+    int32_t reserved;
+    uint64_t keyframe_every; //records between keyframes
+} journal_header_t;
+
+typedef struct
+{
+    uint64_t record; //trace record (1 based) the change belongs to
+    uint64_t tag;
+    uint32_t set;
+    uint16_t way;
+    uint8_t kind;
+    uint8_t dirty;
+} journal_event_t;
+
+typedef struct
+{
+    uint64_t record;
+    uint64_t offset; //file offset of the JOURNAL_KEYFRAME event
+} journal_keyframe_t;
+
+typedef struct
+{
+    uint64_t index_offset; //file offset of the keyframe index
+    uint64_t num_keyframes;
+    char magic[8];
+} journal_trailer_t;
+
+#endif
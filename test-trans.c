@@ -2,7 +2,11 @@
  * test-trans.c - Checks the correctness and performance of all of the
  *     student's transpose functions and records the results for their
  *     official submitted version as well.
+ *
+ *     With -T it instead times every registered function natively, see
+ *     eval_time().
  */
+#define _POSIX_C_SOURCE 200112L /* clock_gettime */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -14,16 +18,18 @@
 #include "cachelab.h"
 #include <sys/wait.h> // fir WEXITSTATUS
 #include <limits.h> // for INT_MAX
-
-/* Maximum array dimension */
-#define MAXN 256
+#include <time.h> // for clock_gettime
 
 /* The description string for the transpose_submit() function that the
    student submits for credit */
 #define SUBMIT_DESCRIPTION "Transpose submission"
 
-/* External function defined in trans.c */
+/* Square sizes timed by -T when -M and -N are not given */
+static int time_sizes[] = {256, 512, 1024, 2048, 4096};
+
+/* External functions defined in trans.c */
 extern void registerFunctions();
+extern int is_transpose(int M, int N, int A[N][M], int B[M][N]);
 
 /* External variables defined in cachelab-tools.c */
 extern trans_func_t func_list[MAX_TRANS_FUNCS];
@@ -32,6 +38,13 @@ extern int func_counter;
 /* Globals set on the command line */
 static int M = 0;
 static int N = 0;
+static int timing = 0;
+static size_t align = 4096;
+static int huge = 0;
+static unsigned int seed = 1;
+static int repetitions = 11;
+static int warmups = 2;
+static int max_threads = 0;
 
 /* The correctness and performance for the submitted transpose function */
 struct results {
@@ -49,6 +62,8 @@ void eval_perf(unsigned int s, unsigned int E, unsigned int b)
     int i,flag;
     unsigned int len, hits, misses, evictions;
     unsigned long long int marker_start, marker_end, addr;
+    unsigned long long int a_start, b_start;
+    unsigned long long int matrix_size = sizeof(int) * (unsigned long long) M * N;
     char buf[1000], cmd[255];
     char filename[128];
 
@@ -68,7 +83,8 @@ void eval_perf(unsigned int s, unsigned int E, unsigned int b)
         printf("\nFunction %d (%d total)\nStep 1: Validating and generating memory traces\n",i,func_counter);
         /* Use valgrind to generate the trace */
 
-        sprintf(cmd, "valgrind --tool=lackey --trace-mem=yes --log-fd=1 -v ./tracegen -M %d -N %d -F %d  > trace.tmp", M, N,i);
+        sprintf(cmd, "valgrind --tool=lackey --trace-mem=yes --log-fd=1 -v ./tracegen -M %d -N %d -F %d -a %zu -s %u%s > trace.tmp",
+                M, N, i, align, seed, huge ? " -H" : "");
         flag=WEXITSTATUS(system(cmd));
         if (0!=flag) {
             printf("Validation error at function %d! Run ./tracegen -M %d -N %d -F %d for details.\nSkipping performance evaluation for this function.\n",flag-1,M,N,i);      
@@ -78,7 +94,8 @@ void eval_perf(unsigned int s, unsigned int E, unsigned int b)
         /* Get the start and end marker addresses */
         FILE* marker_fp = fopen(".marker", "r");
         assert(marker_fp);
-        fscanf(marker_fp, "%llx %llx", &marker_start, &marker_end);
+        fscanf(marker_fp, "%llx %llx %llx %llx", &marker_start, &marker_end,
+               &a_start, &b_start);
         fclose(marker_fp);
 
 
@@ -119,8 +136,12 @@ void eval_perf(unsigned int s, unsigned int E, unsigned int b)
                    address space. At some point it would be nice to
                    try to do more informed filtering so that would
                    eliminate the valgrind stack references while
-                   include the student stack references. */
-                if (flag && addr < 0xffffffff) {
+                   include the student stack references. The heap
+                   allocated matrices can lie above it, so accesses to
+                   them are recorded wherever they are. */
+                if (flag && (addr < 0xffffffff
+                             || (addr >= a_start && addr < a_start + matrix_size)
+                             || (addr >= b_start && addr < b_start + matrix_size))) {
                     fputs(buf, part_trace_fp);
                 }
 
@@ -170,15 +191,201 @@ void eval_perf(unsigned int s, unsigned int E, unsigned int b)
   
 }
 
+/*
+ * now - monotonic time in seconds
+ */
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * time_func - Runs a transpose warmups times untimed, then repetitions
+ *     times timed. Leaves the sorted run times in times, returns 0 if B
+ *     is the transpose of A after every run. B is reset before each run,
+ *     for in-place functions to a copy of A, which is not timed.
+ */
+int time_func(int i, int m, int n, int A[n][m], int B[m][n], double *times)
+{
+    int r;
+    double start;
+
+    for (r = 0; r < warmups; r++) {
+        if (func_list[i].in_place)
+            memcpy(B, A, sizeof(int) * m * n);
+        (*func_list[i].func_ptr)(m, n, A, B);
+    }
+    if (warmups > 0 && !is_transpose(m, n, A, B))
+        return 1;
+    for (r = 0; r < repetitions; r++) {
+        if (func_list[i].in_place)
+            memcpy(B, A, sizeof(int) * m * n);
+        else
+            memset(B, 0, sizeof(int) * m * n);
+        start = now();
+        (*func_list[i].func_ptr)(m, n, A, B);
+        times[r] = now() - start;
+        if (!is_transpose(m, n, A, B))
+            return 1;
+    }
+    qsort(times, repetitions, sizeof(double), compare_doubles);
+    return 0;
+}
+
+/*
+ * eval_speedup - Times parallel function i on 1, 2, 4, ... threads up to
+ *     max_threads and prints each median and its speedup over 1 thread
+ */
+int eval_speedup(int i, int m, int n, int A[n][m], int B[m][n], double *times)
+{
+    int threads = 1;
+    double base = 0, median;
+
+    while (1) {
+        trans_threads = threads;
+        if (time_func(i, m, n, A, B, times) != 0)
+            return 1;
+        median = times[repetitions / 2];
+        if (threads == 1)
+            base = median;
+        printf("%-6d %-6d %-45s threads:%-4d %12.1f %8.2fx\n", m, n,
+               func_list[i].description, threads, median * 1e6, base / median);
+        if (threads == max_threads)
+            break;
+        threads = (threads * 2 < max_threads) ? threads * 2 : max_threads;
+    }
+    trans_threads = max_threads;
+    return 0;
+}
+
+/*
+ * check_funcs - Runs every function once on each of check_shapes and
+ *     reports those whose B is not the transpose of A. The timed sizes
+ *     are all square multiples of 8, these cover the other cases.
+ */
+int check_funcs()
+{
+    int k, i, m, n;
+    int failed = 0;
+    void *A, *B;
+
+    for (k = 0; k < NUM_CHECK_SHAPES; k++) {
+        m = check_shapes[k][0];
+        n = check_shapes[k][1];
+        A = allocMatrix(m, n, align, 0);
+        B = allocMatrix(n, m, align, 0);
+        if (A == NULL || B == NULL) {
+            printf("Error: out of memory for %dx%d\n", m, n);
+            exit(1);
+        }
+        initMatrix(m, n, A, B);
+        for (i = 0; i < func_counter; i++) {
+            /* a fresh B, so no function passes on what the one before wrote */
+            if (func_list[i].in_place)
+                memcpy(B, A, sizeof(int) * m * n);
+            else
+                memset(B, 0, sizeof(int) * m * n);
+            (*func_list[i].func_ptr)(m, n, A, B);
+            if (!is_transpose(m, n, A, B)) {
+                printf("%-6d %-6d %-45s incorrect\n", m, n, func_list[i].description);
+                failed = 1;
+            }
+        }
+        free(A);
+        free(B);
+    }
+    return failed;
+}
+
+/*
+ * eval_time - Times every registered transpose function on the machine
+ *     itself, for the given shape or, without one, for each of
+ *     time_sizes, after checking them with check_funcs. Prints median, 10th and 90th percentile of the run
+ *     times and the bandwidth at the median (a transpose reads and
+ *     writes each element once). Parallel functions run on max_threads
+ *     threads, then their speedup over fewer threads is listed. Build
+ *     with make bench-trans to time optimized code, test-trans links
+ *     trans.o built with -O0.
+ */
+int eval_time()
+{
+    int k, i, m, n;
+    int failed = 0;
+    int num_sizes = (M > 0) ? 1 : sizeof(time_sizes) / sizeof(time_sizes[0]);
+    double *times = malloc(sizeof(double) * repetitions);
+    double median;
+    void *A, *B;
+
+    registerFunctions();
+    trans_threads = max_threads;
+    failed = check_funcs();
+    printf("%-6s %-6s %-45s %12s %12s %12s %8s\n", "M", "N", "function",
+           "median(us)", "p10(us)", "p90(us)", "GB/s");
+    for (k = 0; k < num_sizes; k++) {
+        m = (M > 0) ? M : time_sizes[k];
+        n = (M > 0) ? N : time_sizes[k];
+
+        A = allocMatrix(m, n, align, huge);
+        B = allocMatrix(n, m, align, huge);
+        if (A == NULL || B == NULL) {
+            printf("Error: out of memory for %dx%d\n", m, n);
+            exit(1);
+        }
+        initMatrix(m, n, A, B);
+        for (i = 0; i < func_counter; i++) {
+            if (time_func(i, m, n, A, B, times) != 0) {
+                printf("%-6d %-6d %-45s incorrect\n", m, n, func_list[i].description);
+                failed = 1;
+                continue;
+            }
+            median = times[repetitions / 2];
+            printf("%-6d %-6d %-45s %12.1f %12.1f %12.1f %8.2f\n", m, n,
+                   func_list[i].description, median * 1e6,
+                   times[repetitions / 10] * 1e6,
+                   times[repetitions - 1 - repetitions / 10] * 1e6,
+                   2.0 * sizeof(int) * m * n / median / 1e9);
+        }
+        for (i = 0; i < func_counter; i++) {
+            if (func_list[i].parallel && eval_speedup(i, m, n, A, B, times) != 0) {
+                printf("%-6d %-6d %-45s incorrect\n", m, n, func_list[i].description);
+                failed = 1;
+            }
+        }
+        free(A);
+        free(B);
+    }
+    free(times);
+    return failed;
+}
+
 /*
  * usage - Print usage info
  */
 void usage(char *argv[]){
-    printf("Usage: %s [-h] -M <rows> -N <cols>\n", argv[0]);
+    printf("Usage: %s [-h] -M <rows> -N <cols> [-a <bytes>] [-H] [-s <seed>]\n", argv[0]);
+    printf("       %s -T [-M <rows> -N <cols>] [-r <reps>] [-w <warmups>] [-t <threads>] [-a <bytes>] [-H] [-s <seed>]\n", argv[0]);
     printf("Options:\n");
     printf("  -h          Print this help message.\n");
-    printf("  -M <rows>   Number of matrix rows (max %d)\n", MAXN);
-    printf("  -N <cols>   Number of  matrix columns (max %d)\n", MAXN);
+    printf("  -M <rows>   Number of matrix rows\n");
+    printf("  -N <cols>   Number of  matrix columns\n");
+    printf("  -a <bytes>  Alignment of the matrices (default %zu)\n", align);
+    printf("  -H          Back the matrices with huge pages\n");
+    printf("  -s <seed>   Seed of the matrix contents (default %u)\n", seed);
+    printf("  -T          Time each function natively instead\n");
+    printf("  -r <reps>   Timed runs per function with -T (default %d)\n", repetitions);
+    printf("  -w <runs>   Untimed warm-up runs per function with -T (default %d)\n", warmups);
+    printf("  -t <num>    Most threads of parallel functions with -T (default: CPUs)\n");
     printf("Example: %s -M 8 -N 8\n", argv[0]);       
 }
 
@@ -209,7 +416,7 @@ int main(int argc, char* argv[])
 {
     char c;
 
-    while ((c = getopt(argc,argv,"M:N:h")) != -1) {
+    while ((c = getopt(argc,argv,"M:N:Tr:w:t:a:Hs:h")) != -1) {
         switch(c) {
         case 'M':
             M = atoi(optarg);
@@ -217,6 +424,27 @@ int main(int argc, char* argv[])
         case 'N':
             N = atoi(optarg);
             break;
+        case 'a':
+            align = strtoul(optarg, NULL, 0);
+            break;
+        case 'H':
+            huge = 1;
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            timing = 1;
+            break;
+        case 'r':
+            repetitions = atoi(optarg);
+            break;
+        case 'w':
+            warmups = atoi(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
         case 'h':
             usage(argv);
             exit(0);
@@ -226,14 +454,28 @@ int main(int argc, char* argv[])
         }
     }
   
-    if (M == 0 || N == 0) {
-        printf("Error: Missing required argument\n");
+    if (align < sizeof(void*) || (align & (align - 1)) != 0) {
+        printf("Error: -a must be a power of two\n");
         usage(argv);
         exit(1);
     }
+    setMatrixSeed(seed);
+
+    if (timing) {
+        if (max_threads == 0)
+            max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if ((M == 0) != (N == 0) || M < 0 || N < 0
+                || repetitions < 1 || warmups < 0
+                || max_threads < 1 || max_threads > MAX_TRANS_THREADS) {
+            printf("Error: bad argument for -T\n");
+            usage(argv);
+            exit(1);
+        }
+        return eval_time();
+    }
 
-    if (M > MAXN || N > MAXN) {
-        printf("Error: M or N exceeds %d\n", MAXN);
+    if (M == 0 || N == 0) {
+        printf("Error: Missing required argument\n");
         usage(argv);
         exit(1);
     }
@@ -249,8 +491,8 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
-    /* Time out and give up after a while */
-    alarm(120);
+    /* Time out and give up after a while, longer for large matrices */
+    alarm(120 * (1 + (unsigned long long) M * N / (256 * 256)));
 
     /* Check the performance of the student's transpose function */
     eval_perf(5, 1, 5);
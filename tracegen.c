@@ -4,7 +4,17 @@
  * 
  * The beginning and end of each registered transpose function's trace
  * is indicated by reading from "marker" addresses. These two marker
- * addresses are recorded in file for later use.
+ * addresses are recorded in file for later use, followed by the
+ * addresses of A and B.
+ *
+ * In-place functions get B as a copy of A before their start marker.
+ *
+ * The matrices are heap allocated for any M and N. -a sets their
+ * alignment (default a page), -H asks for huge pages and -s seeds their
+ * contents.
+ *
+ * With -V no trace is made: every function is validated on each of the
+ * small and ragged check_shapes instead, and -M/-N are not needed.
  */
 
 #include <stdlib.h>
@@ -25,34 +35,74 @@ extern void registerFunctions();
 /* Markers used to bound trace regions of interest */
 volatile char MARKER_START, MARKER_END;
 
-static int A_TEMP[256][256];
-static int A[256][256];
-static int B[256][256];
+static void* A_TEMP;
+static void* A;
+static void* B;
 static int M;
 static int N;
 
 
 int validate(int fn,int M, int N, int A[N][M], int B[M][N]) {
-    int C[M][N];
-    memset(C,0,sizeof(C));
+    int (*C)[N] = calloc((size_t) M * N, sizeof(int));
+    assert(C);
     correctTrans(M,N,A,C);
     for(int i=0;i<M;i++) {
         for(int j=0;j<N;j++) {
             if(B[i][j]!=C[i][j]) {
                 printf("Validation failed on function %d! Expected %d but got %d at B[%d][%d]\n",fn,C[i][j],B[i][j],i,j);
+                free(C);
                 return 0;
             }
         }
     }
+    free(C);
     return 1;
 }
 
+/*
+ * validate_shapes - Runs every registered function on each of
+ *     check_shapes and validates its B. Returns 0 if all of them are
+ *     correct, else the number of the last failing function plus 1.
+ */
+int validate_shapes(size_t align) {
+    int failed = 0;
+
+    for (int k = 0; k < NUM_CHECK_SHAPES; k++) {
+        int m = check_shapes[k][0];
+        int n = check_shapes[k][1];
+        void* a = allocMatrix(m, n, align, 0);
+        void* b = allocMatrix(n, m, align, 0);
+        if (a == NULL || b == NULL) {
+            printf("./tracegen is out of memory for %dx%d matrices.\n", m, n);
+            exit(1);
+        }
+        initMatrix(m, n, a, b);
+        for (int i = 0; i < func_counter; i++) {
+            if (func_list[i].in_place)
+                memcpy(b, a, (size_t) m*n*sizeof(int));
+            else
+                memset(b, 0, (size_t) m*n*sizeof(int));
+            (*func_list[i].func_ptr)(m, n, a, b);
+            if (!validate(i, m, n, a, b)) {
+                printf("  (%dx%d, %s)\n", m, n, func_list[i].description);
+                failed = i+1;
+            }
+        }
+        free(a);
+        free(b);
+    }
+    return failed;
+}
+
 int main(int argc, char* argv[]){
     int i;
 
     char c;
     int selectedFunc=-1;
-    while( (c=getopt(argc,argv,"M:N:F:")) != -1){
+    size_t align=4096;
+    int huge=0;
+    int shapes=0;
+    while( (c=getopt(argc,argv,"M:N:F:a:Hs:V")) != -1){
         switch(c){
         case 'M':
             M = atoi(optarg);
@@ -63,6 +113,18 @@ int main(int argc, char* argv[]){
         case 'F':
             selectedFunc = atoi(optarg);
             break;
+        case 'a':
+            align = strtoul(optarg, NULL, 0);
+            break;
+        case 'H':
+            huge = 1;
+            break;
+        case 'V':
+            shapes = 1;
+            break;
+        case 's':
+            setMatrixSeed(strtoul(optarg, NULL, 0));
+            break;
         case '?':
         default:
             printf("./tracegen failed to parse its options.\n");
@@ -70,27 +132,48 @@ int main(int argc, char* argv[]){
         }
     }
   
+    if (shapes && align >= sizeof(void*) && (align & (align - 1)) == 0) {
+        registerFunctions();
+        return validate_shapes(align);
+    }
+
+    if (M <= 0 || N <= 0 || align < sizeof(void*) || (align & (align - 1)) != 0) {
+        printf("./tracegen needs -M and -N and a power of two -a.\n");
+        exit(1);
+    }
 
     /*  Register transpose functions */
     registerFunctions();
 
+    A_TEMP = allocMatrix(M, N, align, 0);
+    A = allocMatrix(M, N, align, huge);
+    B = allocMatrix(N, M, align, huge);
+    if (A_TEMP == NULL || A == NULL || B == NULL) {
+        printf("./tracegen is out of memory for %dx%d matrices.\n", M, N);
+        exit(1);
+    }
+
     /* Fill A with data */
     initMatrix(M,N, A, B);
     
     /* Store initial A values in A_TEMP for correctness check */
-    memcpy(A_TEMP, A, M*N*sizeof(A[0][0]));
+    memcpy(A_TEMP, A, (size_t) M*N*sizeof(int));
 
     /* Record marker addresses */
     FILE* marker_fp = fopen(".marker","w");
     assert(marker_fp);
-    fprintf(marker_fp, "%llx %llx", 
+    fprintf(marker_fp, "%llx %llx %llx %llx", 
             (unsigned long long int) &MARKER_START,
-            (unsigned long long int) &MARKER_END );
+            (unsigned long long int) &MARKER_END,
+            (unsigned long long int) A,
+            (unsigned long long int) B );
     fclose(marker_fp);
 
     if (-1==selectedFunc) {
         /* Invoke registered transpose functions */
         for (i=0; i < func_counter; i++) {
+            if (func_list[i].in_place)
+                memcpy(B, A, (size_t) M*N*sizeof(int));
             MARKER_START = 33;
             (*func_list[i].func_ptr)(M, N, A, B);
             MARKER_END = 34;
@@ -98,6 +181,8 @@ int main(int argc, char* argv[]){
                 return i+1;
         }
     } else {
+        if (func_list[selectedFunc].in_place)
+            memcpy(B, A, (size_t) M*N*sizeof(int));
         MARKER_START = 33;
         (*func_list[selectedFunc].func_ptr)(M, N, A, B);
         MARKER_END = 34;
@@ -0,0 +1,584 @@
+/*
+ * trans-tune.c - searches blocked transpose variants for the one with
+ * the fewest misses on a given cache and matrix shape, and prints it as
+ * a transpose function for trans.c.
+ *
+ * A variant is scored by replaying the loads of A and stores of B it
+ * makes through the simulator of csim.c (see csim.h), no trace is
+ * generated. Locals live on the stack, which test-trans leaves out of
+ * its traces, so only A and B are replayed. By default A is at 0 and B
+ * at the first page after it. That maps onto the sets like tracegen's
+ * page aligned heap matrices whenever S * B is at most a page; -k takes
+ * the addresses of an actual tracegen run from its .marker.
+ *
+ * A variant is a block size, the order in which blocks and the elements
+ * inside a block are visited, and how an element gets from A to B:
+ * directly, directly but with the diagonal element of a row held back
+ * until the rest of the row is stored, or through a row of registers
+ * that is loaded in full before it is stored.
+ *
+ * With -p it instead predicts the misses of one variant the same way,
+ * without tracegen or valgrind, for A and B where a tracegen run put
+ * them (-k .marker). -t checks the prediction against the accesses to A
+ * and B in a full trace of that run.
+ */
+#define _POSIX_C_SOURCE 200112L /* clock_gettime */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "csim.h"
+
+#define ORDER_ROWS 0 //i (rows of A) outer, j (columns of A) inner
+#define ORDER_COLS 1 //j outer, i inner
+
+#define MODE_PLAIN 0 //B[j][i] = A[i][j]
+#define MODE_DIAGONAL 1 //the diagonal element is stored after its row
+#define MODE_REGISTERS 2 //a row is loaded into scalars t0.., then stored
+
+#define MAX_REGISTERS 8 //longest row of a block in MODE_REGISTERS
+
+#define MAX_BLOCK 64
+
+#define PAGE_SIZE 4096 //alignment of tracegen's matrices by default
+
+typedef struct
+{
+    int bh; //rows of A per block
+    int bw; //columns of A per block
+    int block_order;
+    int element_order;
+    int mode;
+    int number; //in enumeration order, simpler variants come first
+    csim_results_t results;
+} variant_t;
+
+const char* order_names[] = {"rows", "cols"};
+const char* mode_names[] = {"plain", "diagonal", "registers"};
+
+typedef struct
+{
+    int M; //columns of A
+    int N; //rows of A
+    unsigned long long a; //address of A[0][0]
+    unsigned long long b; //address of B[0][0]
+} shape_t;
+
+void
+printUsage()
+{
+    printf("Usage: ./trans-tune -M <cols> -N <rows> [-s <s> -E <E> -b <b>]\n");
+    printf("                    [-A <addr> -B <addr>] [-m <max>] [-n <top>] [-o <file>]\n");
+    printf("-M, -N: shape of A, B is its N x M transpose\n");
+    printf("-s, -E, -b: cache geometry (default 5, 1, 5 like test-trans)\n");
+    printf("-A, -B: hex addresses of A and B (default 0 and the first page after A)\n");
+    printf("-m <max>: largest block side tried (default 32)\n");
+    printf("-n <top>: variants listed (default 10)\n");
+    printf("-o <file>: write the best kernel (with -p: this one) to file instead of stdout\n");
+    printf("-p <variant>: only predict the misses of this variant, given as\n");
+    printf("    <bh>x<bw>[:<block order>/<element order>[:<mode>]], e.g. 8x8:rows/cols:diagonal\n");
+    printf("-k <file>: addresses of A and B from a .marker written by tracegen\n");
+    printf("-t <trace>: with -p, also simulate the accesses to A and B of this trace\n");
+}
+
+//replayVariant - the loads and stores of the variant in program order,
+//this must stay in step with emitVariant()
+int
+replayVariant(
+    csim_t* sim,
+    shape_t* shape,
+    variant_t* v
+) {
+    int M = shape->M;
+    int N = shape->N;
+    int outer_step = v->block_order == ORDER_ROWS ? v->bh : v->bw;
+    int outer_limit = v->block_order == ORDER_ROWS ? N : M;
+    int inner_step = v->block_order == ORDER_ROWS ? v->bw : v->bh;
+    int inner_limit = v->block_order == ORDER_ROWS ? M : N;
+    int result = 0;
+
+    for (int bo = 0; bo < outer_limit; bo += outer_step) {
+        for (int bi = 0; bi < inner_limit; bi += inner_step) {
+            int ii = v->block_order == ORDER_ROWS ? bo : bi;
+            int jj = v->block_order == ORDER_ROWS ? bi : bo;
+            //element loops: o outer, e inner
+            int o_first = v->element_order == ORDER_ROWS ? ii : jj;
+            int o_last = v->element_order == ORDER_ROWS ? ii + v->bh : jj + v->bw;
+            int o_limit = v->element_order == ORDER_ROWS ? N : M;
+            int e_first = v->element_order == ORDER_ROWS ? jj : ii;
+            int e_last = v->element_order == ORDER_ROWS ? jj + v->bw : ii + v->bh;
+            int e_limit = v->element_order == ORDER_ROWS ? M : N;
+
+            for (int o = o_first; o < o_last && o < o_limit; o++) {
+                for (int e = e_first; e < e_last && e < e_limit; e++) {
+                    int i = v->element_order == ORDER_ROWS ? o : e;
+                    int j = v->element_order == ORDER_ROWS ? e : o;
+                    result |= csimAccess(sim, 'L', shape->a + 4ULL * ((long long) i * M + j), 4);
+                    if (v->mode == MODE_PLAIN || (v->mode == MODE_DIAGONAL && i != j)) {
+                        result |= csimAccess(sim, 'S', shape->b + 4ULL * ((long long) j * N + i), 4);
+                    }
+                }
+                if (v->mode == MODE_REGISTERS) {
+                    for (int e = e_first; e < e_last && e < e_limit; e++) {
+                        int i = v->element_order == ORDER_ROWS ? o : e;
+                        int j = v->element_order == ORDER_ROWS ? e : o;
+                        result |= csimAccess(sim, 'S', shape->b + 4ULL * ((long long) j * N + i), 4);
+                    }
+                }
+                if (v->mode == MODE_DIAGONAL && o >= e_first && o < e_last && o < e_limit) {
+                    result |= csimAccess(sim, 'S', shape->b + 4ULL * ((long long) o * N + o), 4);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+//emitVariant - the variant as a transpose function for trans.c
+void
+emitVariant(
+    FILE* fp,
+    shape_t* shape,
+    variant_t* v,
+    int s,
+    int E,
+    int b
+) {
+    const char* bo = v->block_order == ORDER_ROWS ? "ii" : "jj";
+    const char* bi = v->block_order == ORDER_ROWS ? "jj" : "ii";
+    const char* o = v->element_order == ORDER_ROWS ? "i" : "j";
+    const char* e = v->element_order == ORDER_ROWS ? "j" : "i";
+    const char* oo = v->element_order == ORDER_ROWS ? "ii" : "jj";
+    const char* ee = v->element_order == ORDER_ROWS ? "jj" : "ii";
+    int bo_step = v->block_order == ORDER_ROWS ? v->bh : v->bw;
+    int bi_step = v->block_order == ORDER_ROWS ? v->bw : v->bh;
+    int o_step = v->element_order == ORDER_ROWS ? v->bh : v->bw;
+    int e_step = v->element_order == ORDER_ROWS ? v->bw : v->bh;
+    const char* o_limit = v->element_order == ORDER_ROWS ? "N" : "M";
+    const char* e_limit = v->element_order == ORDER_ROWS ? "M" : "N";
+    const char* bo_limit = v->block_order == ORDER_ROWS ? "N" : "M";
+    const char* bi_limit = v->block_order == ORDER_ROWS ? "M" : "N";
+
+    fprintf(fp, "//%dx%d blocks, %s of blocks, %s inside a block, %s. Found by\n",
+            v->bh, v->bw, order_names[v->block_order], order_names[v->element_order],
+            mode_names[v->mode]);
+    fprintf(fp, "//trans-tune for %dx%d on s=%d E=%d b=%d: %d misses.\n",
+            shape->M, shape->N, s, E, b, v->results.misses);
+    fprintf(fp, "char trans_tuned_desc[] = \"Tuned %dx%d %s/%s %s\";\n",
+            v->bh, v->bw, order_names[v->block_order], order_names[v->element_order],
+            mode_names[v->mode]);
+    fprintf(fp, "void trans_tuned(int M, int N, int A[N][M], int B[M][N])\n{\n");
+    if (v->mode == MODE_REGISTERS) {
+        //the row is unrolled into scalars, arrays are not allowed
+        //zeroed on ragged shapes, where some are only set under a guard
+        int ragged = (v->element_order == ORDER_ROWS ? shape->M : shape->N) % e_step != 0;
+        fprintf(fp, "    int ii, jj, %s;\n", o);
+        fprintf(fp, "    int");
+        for (int k = 0; k < e_step; k++) {
+            fprintf(fp, "%s t%d%s", k ? "," : "", k, ragged ? " = 0" : "");
+        }
+        fprintf(fp, ";\n");
+    } else {
+        fprintf(fp, "    int ii, jj, i, j;\n");
+    }
+    if (v->mode == MODE_DIAGONAL) {
+        fprintf(fp, "    int d = 0;\n");
+    }
+    fprintf(fp, "\n    for (%s = 0; %s < %s; %s += %d) {\n", bo, bo, bo_limit, bo, bo_step);
+    fprintf(fp, "        for (%s = 0; %s < %s; %s += %d) {\n", bi, bi, bi_limit, bi, bi_step);
+    fprintf(fp, "            for (%s = %s; %s < %s + %d && %s < %s; %s++) {\n",
+            o, oo, o, oo, o_step, o, o_limit, o);
+    if (v->mode == MODE_REGISTERS) {
+        //a guard per element only when the blocks do not divide the shape
+        int ragged = (v->element_order == ORDER_ROWS ? shape->M : shape->N) % e_step != 0;
+
+        for (int pass = 0; pass < 2; pass++) {
+            for (int k = 0; k < e_step; k++) {
+                const char* indent = "                ";
+                char a[64];
+                char b[64];
+                if (v->element_order == ORDER_ROWS) {
+                    snprintf(a, sizeof(a), "A[i][jj + %d]", k);
+                    snprintf(b, sizeof(b), "B[jj + %d][i]", k);
+                } else {
+                    snprintf(a, sizeof(a), "A[ii + %d][j]", k);
+                    snprintf(b, sizeof(b), "B[j][ii + %d]", k);
+                }
+                if (ragged && k > 0) {
+                    fprintf(fp, "%sif (%s + %d < %s)\n", indent, ee, k, e_limit);
+                    indent = "                    ";
+                }
+                if (pass == 0) {
+                    fprintf(fp, "%st%d = %s;\n", indent, k, a);
+                } else {
+                    fprintf(fp, "%s%s = t%d;\n", indent, b, k);
+                }
+            }
+        }
+        fprintf(fp, "            }\n        }\n    }\n}\n");
+        return;
+    }
+    fprintf(fp, "                for (%s = %s; %s < %s + %d && %s < %s; %s++) {\n",
+            e, ee, e, ee, e_step, e, e_limit, e);
+    switch (v->mode) {
+    case MODE_PLAIN:
+        fprintf(fp, "                    B[j][i] = A[i][j];\n");
+        break;
+    case MODE_DIAGONAL:
+        fprintf(fp, "                    if (i == j) {\n");
+        fprintf(fp, "                        d = A[i][j];\n");
+        fprintf(fp, "                    } else {\n");
+        fprintf(fp, "                        B[j][i] = A[i][j];\n");
+        fprintf(fp, "                    }\n");
+        break;
+    }
+    fprintf(fp, "                }\n");
+    if (v->mode == MODE_DIAGONAL) {
+        fprintf(fp, "                if (%s >= %s && %s < %s + %d && %s < %s) {\n",
+                o, ee, o, ee, e_step, o, e_limit);
+        fprintf(fp, "                    B[%s][%s] = d;\n", o, o);
+        fprintf(fp, "                }\n");
+    }
+    fprintf(fp, "            }\n        }\n    }\n}\n");
+}
+
+//parseVariant - a variant from its -p description, orders default to
+//rows and the mode to plain
+int
+parseVariant(
+    char* spec,
+    variant_t* v
+) {
+    char block_order[8] = "rows";
+    char element_order[8] = "rows";
+    char mode[16] = "plain";
+    int fields = sscanf(spec, "%dx%d:%7[a-z]/%7[a-z]:%15[a-z]", &v->bh, &v->bw,
+                        block_order, element_order, mode);
+    int found = 0;
+
+    if (fields < 2 || fields == 3 || v->bh < 1 || v->bw < 1) {
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (strcmp(block_order, order_names[i]) == 0) {
+            v->block_order = i;
+            found++;
+        }
+        if (strcmp(element_order, order_names[i]) == 0) {
+            v->element_order = i;
+            found++;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(mode, mode_names[i]) == 0) {
+            v->mode = i;
+            found++;
+        }
+    }
+    if (v->mode == MODE_REGISTERS
+            && (v->element_order == ORDER_ROWS ? v->bw : v->bh) > MAX_REGISTERS) {
+        return 1;
+    }
+    return found != 3;
+}
+
+//readMarker - A and B as recorded by tracegen after the marker addresses
+int
+readMarker(
+    char* path,
+    shape_t* shape
+) {
+    unsigned long long start;
+    unsigned long long end;
+    FILE* fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        printf("Error: failed to open file - %s\n", path);
+        return 1;
+    }
+    if (fscanf(fp, "%llx %llx %llx %llx", &start, &end, &shape->a, &shape->b) != 4) {
+        printf("Error: no matrix addresses in %s, rerun tracegen\n", path);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+//replayTrace - the loads, stores and modifies of A and B in a trace
+//(csim or valgrind format), everything else is not predicted
+int
+replayTrace(
+    csim_t* sim,
+    shape_t* shape,
+    char* path
+) {
+    unsigned long long size = 4ULL * shape->M * shape->N;
+    unsigned long long address;
+    char line[256];
+    int bytes;
+    int result = 0;
+    FILE* fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        printf("Error: failed to open file - %s\n", path);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] != ' ' || line[2] != ' '
+                || (line[1] != 'L' && line[1] != 'S' && line[1] != 'M')
+                || sscanf(line + 3, "%llx,%d", &address, &bytes) != 2) {
+            continue;
+        }
+        if ((address >= shape->a && address < shape->a + size)
+                || (address >= shape->b && address < shape->b + size)) {
+            result |= csimAccess(sim, line[1], address, bytes);
+        }
+    }
+    fclose(fp);
+    return result;
+}
+
+//predictVariant - -p: misses of one variant and, with a trace, those of
+//the trace. Returns non-zero if they differ.
+int
+predictVariant(
+    csim_t* sim,
+    shape_t* shape,
+    variant_t* v,
+    char* trace
+) {
+    csim_results_t traced;
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (replayVariant(sim, shape, v) != 0) {
+        printf("Error: simulation failed\n");
+        return 1;
+    }
+    csimResults(sim, &v->results);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("predicted %dx%d %s/%s %s: hits:%d misses:%d evictions:%d (%.1f us)\n",
+           v->bh, v->bw, order_names[v->block_order], order_names[v->element_order],
+           mode_names[v->mode], v->results.hits, v->results.misses,
+           v->results.evictions,
+           (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3);
+    if (trace == NULL) {
+        return 0;
+    }
+    if (csimReset(sim) != 0 || replayTrace(sim, shape, trace) != 0) {
+        printf("Error: simulation of %s failed\n", trace);
+        return 1;
+    }
+    csimResults(sim, &traced);
+    printf("traced: hits:%d misses:%d evictions:%d\n", traced.hits,
+           traced.misses, traced.evictions);
+    if (traced.hits != v->results.hits || traced.misses != v->results.misses
+            || traced.evictions != v->results.evictions) {
+        printf("prediction differs from the trace\n");
+        return 1;
+    }
+    printf("prediction matches the trace\n");
+    return 0;
+}
+
+//compareVariants - fewer misses, then fewer evictions, then bigger
+//blocks (less loop overhead), then the one enumerated first
+int
+compareVariants(
+    const void* a,
+    const void* b
+) {
+    const variant_t* va = a;
+    const variant_t* vb = b;
+
+    if (va->results.misses != vb->results.misses) {
+        return va->results.misses < vb->results.misses ? -1 : 1;
+    }
+    if (va->results.evictions != vb->results.evictions) {
+        return va->results.evictions < vb->results.evictions ? -1 : 1;
+    }
+    if (va->bh * va->bw != vb->bh * vb->bw) {
+        return va->bh * va->bw > vb->bh * vb->bw ? -1 : 1;
+    }
+    return va->number - vb->number;
+}
+
+int
+main(
+    int argc,
+    char* argv[]
+) {
+    shape_t shape = {0, 0, 0, 0};
+    int b_given = 0;
+    int s = 5;
+    int E = 1;
+    int b = 5;
+    int max_block = 32;
+    int top = 10;
+    char* output = NULL;
+    char* predict = NULL;
+    char* marker = NULL;
+    char* trace = NULL;
+    variant_t* variants;
+    int num_variants = 0;
+    csim_t* sim;
+    FILE* fp = stdout;
+    int c;
+
+    while ((c = getopt(argc, argv, "M:N:s:E:b:A:B:m:n:o:p:k:t:h")) != -1) {
+        switch (c) {
+        case 'M':
+            shape.M = atoi(optarg);
+            break;
+        case 'N':
+            shape.N = atoi(optarg);
+            break;
+        case 's':
+            s = atoi(optarg);
+            break;
+        case 'E':
+            E = atoi(optarg);
+            break;
+        case 'b':
+            b = atoi(optarg);
+            break;
+        case 'A':
+            shape.a = strtoull(optarg, NULL, 16);
+            break;
+        case 'B':
+            shape.b = strtoull(optarg, NULL, 16);
+            b_given = 1;
+            break;
+        case 'm':
+            max_block = atoi(optarg);
+            break;
+        case 'n':
+            top = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'p':
+            predict = optarg;
+            break;
+        case 'k':
+            marker = optarg;
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        case 'h':
+            printUsage();
+            exit(0);
+        default:
+            printUsage();
+            exit(-1);
+        }
+    }
+    if (shape.M <= 0 || shape.N <= 0) {
+        printf("Error: -M and -N are required\n");
+        printUsage();
+        exit(-1);
+    }
+    if (!b_given) {
+        unsigned long long end = shape.a + 4ULL * shape.M * shape.N;
+        shape.b = (end + PAGE_SIZE - 1) & ~(unsigned long long) (PAGE_SIZE - 1);
+    }
+    if (marker != NULL && readMarker(marker, &shape) != 0) {
+        exit(1);
+    }
+    if (trace != NULL && predict == NULL) {
+        printf("Error: -t needs -p\n");
+        exit(-1);
+    }
+    if (max_block < 1 || max_block > MAX_BLOCK) {
+        max_block = MAX_BLOCK;
+    }
+    sim = csimCreate(s, E, b);
+    if (sim == NULL) {
+        printf("Error: failed to initialize cache (s=%d, E=%d, b=%d)\n", s, E, b);
+        exit(1);
+    }
+    if (predict != NULL) {
+        variant_t v = {0};
+        int result;
+
+        if (parseVariant(predict, &v) != 0) {
+            printf("Error: bad variant - %s\n", predict);
+            printUsage();
+            exit(-1);
+        }
+        result = predictVariant(sim, &shape, &v, trace);
+        csimFree(sim);
+        if (output != NULL) {
+            fp = fopen(output, "w");
+            if (fp == NULL) {
+                printf("Error: failed to open file - %s\n", output);
+                exit(1);
+            }
+            emitVariant(fp, &shape, &v, s, E, b);
+            fclose(fp);
+        }
+        return result;
+    }
+    variants = calloc((size_t) max_block * max_block * 2 * 2 * 3, sizeof(variant_t));
+    if (variants == NULL) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    for (int mode = MODE_PLAIN; mode <= MODE_REGISTERS; mode++) {
+        for (int bh = 1; bh <= max_block && bh <= shape.N; bh++) {
+            for (int bw = 1; bw <= max_block && bw <= shape.M; bw++) {
+                for (int order = 0; order < 4; order++) {
+                    variant_t* v = &variants[num_variants];
+                    v->number = num_variants++;
+                    v->bh = bh;
+                    v->bw = bw;
+                    v->block_order = order >> 1;
+                    v->element_order = order & 1;
+                    v->mode = mode;
+                    if (mode == MODE_REGISTERS
+                            && (v->element_order == ORDER_ROWS ? bw : bh) > MAX_REGISTERS) {
+                        num_variants--;
+                        continue;
+                    }
+                    if (csimReset(sim) != 0 || replayVariant(sim, &shape, v) != 0) {
+                        printf("Error: simulation failed\n");
+                        exit(1);
+                    }
+                    csimResults(sim, &v->results);
+                }
+            }
+        }
+    }
+    csimFree(sim);
+    qsort(variants, num_variants, sizeof(variant_t), compareVariants);
+
+    printf("%d variants of %dx%d on s=%d E=%d b=%d\n", num_variants,
+           shape.M, shape.N, s, E, b);
+    printf("misses\tevictions\tblock\torder\tmode\n");
+    for (int i = 0; i < top && i < num_variants; i++) {
+        variant_t* v = &variants[i];
+        printf("%d\t%d\t%dx%d\t%s/%s\t%s\n", v->results.misses, v->results.evictions,
+               v->bh, v->bw, order_names[v->block_order],
+               order_names[v->element_order], mode_names[v->mode]);
+    }
+    if (output != NULL) {
+        fp = fopen(output, "w");
+        if (fp == NULL) {
+            printf("Error: failed to open file - %s\n", output);
+            exit(1);
+        }
+    } else {
+        printf("\n");
+    }
+    emitVariant(fp, &shape, &variants[0], s, E, b);
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    free(variants);
+    return 0;
+}
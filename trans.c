@@ -8,7 +8,13 @@
  * on a 1KB direct mapped cache with a block size of 32 bytes.
  */ 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "cachelab.h"
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 int is_transpose(int M, int N, int A[N][M], int B[M][N]);
 
@@ -45,7 +51,7 @@ void trans_32_32(int M, int N, int A[N][M], int B[M][N])
 }
 //My transpose 61x67 function works for 64x64, for block_size 4. 
 void trans_64_64_test(int M, int N, int A[N][M], int B[M][N]) {
-	int i;
+	int i = 0;
 	int block_i;
 	int block_j; 
     const int block_size = 4;   
@@ -140,7 +146,7 @@ void trans_64_64(int M, int N, int A[N][M], int B[M][N]) {
 //For this function, I used a similar approach as 32x32, but used block_size 18
 //to avoid conflict miss. 
 void trans_61_67(int M, int N, int A[N][M], int B[M][N]) {
-	int i;
+	int i = 0;
 	int block_i;
 	int block_j; 
     const int block_size = 18;    //tried block size 16, 17, 18, 19, 20
@@ -164,6 +170,427 @@ void trans_61_67(int M, int N, int A[N][M], int B[M][N]) {
 	}
 }
 
+/*
+ * Generic kernels for shapes without a hand-tuned function. The cache
+ * test-trans simulates holds 32 lines of 8 ints, one per set.
+ */
+#define LINE_INTS 8
+#define CACHE_BYTES 1024
+#define TILE 16 //largest side of a tile trans_recursive transposes directly
+#define SMALL_MATRIX (256 * 256) //elements, larger ones go to trans_recursive
+
+//strip_width - columns of A that trans_blocked transposes together. Up
+//to a line of A, but rows of B that far apart must not start at the same
+//offset into the cache or they would keep evicting each other.
+int strip_width(int N)
+{
+    int width = 1;
+
+    while (width < LINE_INTS && (width * N * sizeof(int)) % CACHE_BYTES != 0) {
+        width++;
+    }
+    return width;
+}
+
+//trans_tile - rows i0..i1-1 and columns j0..j1-1 of A, a row at a time.
+//The diagonal element shares a set with its row of B when A and B are
+//aligned alike, so it is stored after the rest of the row.
+void trans_tile(int M, int N, int A[N][M], int B[M][N],
+                int i0, int i1, int j0, int j1)
+{
+    int i, j;
+    int diagonal = 0;
+    int has_diagonal;
+
+    for (i = i0; i < i1; i++) {
+        has_diagonal = 0;
+        for (j = j0; j < j1; j++) {
+            if (i != j) {
+                B[j][i] = A[i][j];
+            } else {
+                diagonal = A[i][i];
+                has_diagonal = 1;
+            }
+        }
+        if (has_diagonal) {
+            B[i][i] = diagonal;
+        }
+    }
+}
+
+//trans_blocked - any shape, in strips of strip_width() columns of A that
+//run over all of its rows. Ragged edges are just narrower strips.
+char trans_blocked_desc[] = "Blocked transpose, strips sized for the cache";
+void trans_blocked(int M, int N, int A[N][M], int B[M][N])
+{
+    int width = strip_width(N);
+    int jj;
+
+    for (jj = 0; jj < M; jj += width) {
+        trans_tile(M, N, A, B, 0, N, jj, jj + width < M ? jj + width : M);
+    }
+}
+
+//trans_range - halves the longer side of the range until it is a tile,
+//splitting at a multiple of a line where it can. Every level of the
+//memory hierarchy eventually holds a whole subproblem, whatever its size.
+void trans_range(int M, int N, int A[N][M], int B[M][N],
+                 int i0, int i1, int j0, int j1)
+{
+    int mid;
+
+    if (i1 - i0 <= TILE && j1 - j0 <= TILE) {
+        trans_tile(M, N, A, B, i0, i1, j0, j1);
+    } else if (i1 - i0 >= j1 - j0) {
+        mid = i0 + ((i1 - i0) / 2 + LINE_INTS - 1) / LINE_INTS * LINE_INTS;
+        if (mid >= i1) {
+            mid = i0 + (i1 - i0) / 2;
+        }
+        trans_range(M, N, A, B, i0, mid, j0, j1);
+        trans_range(M, N, A, B, mid, i1, j0, j1);
+    } else {
+        mid = j0 + ((j1 - j0) / 2 + LINE_INTS - 1) / LINE_INTS * LINE_INTS;
+        if (mid >= j1) {
+            mid = j0 + (j1 - j0) / 2;
+        }
+        trans_range(M, N, A, B, i0, i1, j0, mid);
+        trans_range(M, N, A, B, i0, i1, mid, j1);
+    }
+}
+
+//trans_recursive - cache-oblivious, any shape
+char trans_recursive_desc[] = "Recursive cache-oblivious transpose";
+void trans_recursive(int M, int N, int A[N][M], int B[M][N])
+{
+    trans_range(M, N, A, B, 0, N, 0, M);
+}
+
+/*
+ * SIMD kernels for native runs: 4x4 (SSE2) or 8x8 (AVX2) tiles of A are
+ * loaded a row per register, transposed in registers and stored a row
+ * of B per register. Tiles are visited in SIMD_BLOCK squares so the rows
+ * of B being written stay cached, edges that are not a whole tile are
+ * done by trans_tile. AVX2 is only registered when the CPU has it.
+ */
+#ifdef __x86_64__
+#define SIMD_BLOCK 32
+
+//trans_edges - what the tiles of a kernel of this tile size left over
+void trans_edges(int M, int N, int A[N][M], int B[M][N], int tile)
+{
+    int full_rows = N - N % tile;
+    int full_cols = M - M % tile;
+
+    if (full_cols < M) {
+        trans_tile(M, N, A, B, 0, full_rows, full_cols, M);
+    }
+    if (full_rows < N) {
+        trans_tile(M, N, A, B, full_rows, N, 0, M);
+    }
+}
+
+//trans_sse2_4x4 - the 4x4 tile of A at row i, column j
+void trans_sse2_4x4(int M, int N, int A[N][M], int B[M][N], int i, int j)
+{
+    __m128i r0 = _mm_loadu_si128((__m128i *) &A[i][j]);
+    __m128i r1 = _mm_loadu_si128((__m128i *) &A[i + 1][j]);
+    __m128i r2 = _mm_loadu_si128((__m128i *) &A[i + 2][j]);
+    __m128i r3 = _mm_loadu_si128((__m128i *) &A[i + 3][j]);
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+    _mm_storeu_si128((__m128i *) &B[j][i], _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *) &B[j + 1][i], _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *) &B[j + 2][i], _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i *) &B[j + 3][i], _mm_unpackhi_epi64(t2, t3));
+}
+
+//trans_sse2_range - like trans_tile, in 4x4 tiles where they fit
+void trans_sse2_range(int M, int N, int A[N][M], int B[M][N],
+                      int i0, int i1, int j0, int j1)
+{
+    int i, j;
+    int full_i1 = i1 - (i1 - i0) % 4;
+    int full_j1 = j1 - (j1 - j0) % 4;
+
+    for (i = i0; i < full_i1; i += 4) {
+        for (j = j0; j < full_j1; j += 4) {
+            trans_sse2_4x4(M, N, A, B, i, j);
+        }
+    }
+    if (full_j1 < j1) {
+        trans_tile(M, N, A, B, i0, full_i1, full_j1, j1);
+    }
+    if (full_i1 < i1) {
+        trans_tile(M, N, A, B, full_i1, i1, j0, j1);
+    }
+}
+
+char trans_sse2_desc[] = "SSE2 4x4 register transpose";
+void trans_sse2(int M, int N, int A[N][M], int B[M][N])
+{
+    int ii, jj, i, j;
+
+    for (ii = 0; ii + 4 <= N; ii += SIMD_BLOCK) {
+        for (jj = 0; jj + 4 <= M; jj += SIMD_BLOCK) {
+            for (i = ii; i < ii + SIMD_BLOCK && i + 4 <= N; i += 4) {
+                for (j = jj; j < jj + SIMD_BLOCK && j + 4 <= M; j += 4) {
+                    trans_sse2_4x4(M, N, A, B, i, j);
+                }
+            }
+        }
+    }
+    trans_edges(M, N, A, B, 4);
+}
+
+//the 8 rows of a tile are interleaved in three rounds: 32 bit elements
+//within 128 bit lanes, then 64 bit pairs, then the lanes themselves
+char trans_avx2_desc[] = "AVX2 8x8 register transpose";
+__attribute__((target("avx2")))
+void trans_avx2(int M, int N, int A[N][M], int B[M][N])
+{
+    int ii, jj, i, j, k;
+    __m256i r[8];
+    __m256i t[8];
+    __m256i u[8];
+
+    for (ii = 0; ii + 8 <= N; ii += SIMD_BLOCK) {
+        for (jj = 0; jj + 8 <= M; jj += SIMD_BLOCK) {
+            for (i = ii; i < ii + SIMD_BLOCK && i + 8 <= N; i += 8) {
+                for (j = jj; j < jj + SIMD_BLOCK && j + 8 <= M; j += 8) {
+                    for (k = 0; k < 8; k++) {
+                        r[k] = _mm256_loadu_si256((__m256i *) &A[i + k][j]);
+                    }
+                    for (k = 0; k < 8; k += 2) {
+                        t[k] = _mm256_unpacklo_epi32(r[k], r[k + 1]);
+                        t[k + 1] = _mm256_unpackhi_epi32(r[k], r[k + 1]);
+                    }
+                    for (k = 0; k < 8; k += 4) {
+                        u[k] = _mm256_unpacklo_epi64(t[k], t[k + 2]);
+                        u[k + 1] = _mm256_unpackhi_epi64(t[k], t[k + 2]);
+                        u[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+                        u[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+                    }
+                    for (k = 0; k < 4; k++) {
+                        _mm256_storeu_si256((__m256i *) &B[j + k][i],
+                                            _mm256_permute2x128_si256(u[k], u[k + 4], 0x20));
+                        _mm256_storeu_si256((__m256i *) &B[j + k + 4][i],
+                                            _mm256_permute2x128_si256(u[k], u[k + 4], 0x31));
+                    }
+                }
+            }
+        }
+    }
+    trans_edges(M, N, A, B, 8);
+}
+#endif
+
+/*
+ * Parallel kernels for native runs. B is cut into bands of PAR_BAND rows
+ * (columns of A) that are transposed by a range function like
+ * trans_tile. PAR_BAND is a multiple of 16 ints, so when B starts on a
+ * cache line so does every band, and no two threads write the same line
+ * of B. Each thread gets one contiguous run of bands. The threads are
+ * not pinned and B is not placed by them, so nothing here is NUMA aware.
+ */
+#define PAR_BAND 32
+
+typedef void (*trans_range_t)(int M, int N, int A[N][M], int B[M][N],
+                              int i0, int i1, int j0, int j1);
+
+typedef struct {
+    int M;
+    int N;
+    void* A;
+    void* B;
+    int j0;
+    int j1;
+    trans_range_t range;
+} trans_part_t;
+
+//trans_part - one thread's bands in PAR_BAND squares, row blocks of A
+//outside so that A is read along its rows
+void* trans_part(void* arg)
+{
+    trans_part_t* part = arg;
+    int M = part->M;
+    int N = part->N;
+    int i, j;
+
+    for (i = 0; i < N; i += PAR_BAND) {
+        for (j = part->j0; j < part->j1; j += PAR_BAND) {
+            part->range(M, N, part->A, part->B,
+                        i, i + PAR_BAND < N ? i + PAR_BAND : N,
+                        j, j + PAR_BAND < part->j1 ? j + PAR_BAND : part->j1);
+        }
+    }
+    return NULL;
+}
+
+//trans_parallel - range over the bands on trans_threads threads, the
+//caller's thread included. A thread that fails to start is done inline.
+void trans_parallel(int M, int N, int A[N][M], int B[M][N], trans_range_t range)
+{
+    int bands = (M + PAR_BAND - 1) / PAR_BAND;
+    int threads = trans_threads;
+    pthread_t ids[MAX_TRANS_THREADS];
+    trans_part_t parts[MAX_TRANS_THREADS];
+    char started[MAX_TRANS_THREADS];
+    int t;
+
+    if (threads > MAX_TRANS_THREADS)
+        threads = MAX_TRANS_THREADS;
+    if (threads > bands)
+        threads = bands;
+    if (threads < 1)
+        threads = 1;
+    for (t = 0; t < threads; t++) {
+        parts[t].M = M;
+        parts[t].N = N;
+        parts[t].A = A;
+        parts[t].B = B;
+        parts[t].j0 = (long) bands * t / threads * PAR_BAND;
+        parts[t].j1 = (long) bands * (t + 1) / threads * PAR_BAND;
+        if (parts[t].j1 > M)
+            parts[t].j1 = M;
+        parts[t].range = range;
+    }
+    for (t = 1; t < threads; t++) {
+        started[t] = pthread_create(&ids[t], NULL, trans_part, &parts[t]) == 0;
+    }
+    trans_part(&parts[0]);
+    for (t = 1; t < threads; t++) {
+        if (started[t])
+            pthread_join(ids[t], NULL);
+        else
+            trans_part(&parts[t]);
+    }
+}
+
+char trans_par_blocked_desc[] = "Parallel blocked transpose";
+void trans_par_blocked(int M, int N, int A[N][M], int B[M][N])
+{
+    trans_parallel(M, N, A, B, trans_tile);
+}
+
+#ifdef __x86_64__
+char trans_par_sse2_desc[] = "Parallel SSE2 4x4 register transpose";
+void trans_par_sse2(int M, int N, int A[N][M], int B[M][N])
+{
+    trans_parallel(M, N, A, B, trans_sse2_range);
+}
+#endif
+
+/*
+ * In-place kernels. They get B holding a copy of A (the harnesses make
+ * it) and transpose B in its own storage, A is not touched. A square
+ * matrix is transposed by swapping LINE_INTS x LINE_INTS blocks across
+ * the diagonal. Any other shape is transposed by cycle following, see
+ * trans_cycles.
+ */
+
+//trans_swap_blocks - swaps block (i0, j0) with the transpose of block
+//(j0, i0), the blocks are the same on the diagonal
+void trans_swap_blocks(int N, int B[N][N], int i0, int j0)
+{
+    int i, j, tmp;
+    int i1 = i0 + LINE_INTS < N ? i0 + LINE_INTS : N;
+    int j1 = j0 + LINE_INTS < N ? j0 + LINE_INTS : N;
+
+    for (i = i0; i < i1; i++) {
+        for (j = (i0 == j0) ? i + 1 : j0; j < j1; j++) {
+            tmp = B[i][j];
+            B[i][j] = B[j][i];
+            B[j][i] = tmp;
+        }
+    }
+}
+
+//trans_cycles - transposes the rows x cols matrix of elements of width
+//ints at p into a cols x rows one. The element at k goes to k * rows
+//mod (rows * cols - 1), each cycle of that permutation is followed once,
+//the elements already moved are marked in done.
+void trans_cycles(int* p, int rows, int cols, int width, char* done)
+{
+    unsigned long long last = (unsigned long long) rows * cols - 1;
+    unsigned long long start, k, src;
+    int tmp[LINE_INTS];
+    int w;
+
+    memset(done, 0, last + 1);
+    for (start = 1; start < last; start++) {
+        if (done[start])
+            continue;
+        for (w = 0; w < width; w++)
+            tmp[w] = p[start * width + w];
+        k = start;
+        //pull into k the element that belongs there
+        while ((src = k * cols % last) != start) {
+            for (w = 0; w < width; w++)
+                p[k * width + w] = p[src * width + w];
+            done[k] = 1;
+            k = src;
+        }
+        for (w = 0; w < width; w++)
+            p[k * width + w] = tmp[w];
+        done[k] = 1;
+    }
+}
+
+char trans_in_place_desc[] = "In-place cycle-following transpose";
+//Cycles of single ints jump all over the matrix. Instead, rows are cut
+//into runs of width ints that move as a unit, a run is a line when the
+//width is LINE_INTS: the N x M/width matrix of runs is transposed first,
+//then every N x width band it leaves, which is contiguous and small.
+//width is the largest power of two up to LINE_INTS dividing M.
+void trans_in_place(int M, int N, int A[N][M], int B[M][N])
+{
+    int* p = &B[0][0];
+    int width = LINE_INTS;
+    int band;
+    size_t marks;
+    char* done;
+
+    while (M % width != 0) {
+        width /= 2;
+    }
+    //marks for the runs, then reused for the elements of one band
+    marks = (size_t) M * N / width;
+    if (marks < (size_t) N * width)
+        marks = (size_t) N * width;
+    done = malloc(marks);
+    if (done == NULL) {
+        //no memory for the marks, transpose like the others do
+        trans_tile(M, N, A, B, 0, N, 0, M);
+        return;
+    }
+    trans_cycles(p, N, M / width, width, done);
+    if (width > 1) {
+        for (band = 0; band < M / width; band++) {
+            trans_cycles(p + (long) band * N * width, N, width, 1, done);
+        }
+    }
+    free(done);
+}
+
+char trans_in_place_square_desc[] = "In-place blocked swap transpose";
+void trans_in_place_square(int M, int N, int A[N][M], int B[M][N])
+{
+    int ii, jj;
+
+    if (M != N) {
+        trans_in_place(M, N, A, B);
+        return;
+    }
+    for (ii = 0; ii < N; ii += LINE_INTS) {
+        for (jj = ii; jj < N; jj += LINE_INTS) {
+            trans_swap_blocks(N, B, ii, jj);
+        }
+    }
+}
+
 /* 
  * trans - A simple baseline transpose function, not optimized for the cache.
  */
@@ -191,12 +618,14 @@ void trans(int M, int N, int A[N][M], int B[M][N])
 char transpose_submit_desc[] = "Transpose submission";
 void transpose_submit(int M, int N, int A[N][M], int B[M][N])
 {
+	//trans_blocked beats trans_64_64_test and trans_61_67 on their own
+	//shapes, so only 32x32 keeps its hand-tuned function
 	if (M == 32 && N == 32) {
 		trans_32_32(M,N,A,B);
-	} else if (M == 64 && N == 64) {
-        trans_64_64_test(M,N,A,B);
-    } else if (M == 61 && N == 67) {
-        trans_61_67(M,N,A,B);
+    } else if (M * N <= SMALL_MATRIX) {
+        trans_blocked(M,N,A,B);
+    } else {
+        trans_recursive(M,N,A,B);
     }
 }
 
@@ -215,6 +644,20 @@ void registerFunctions()
 
     /* Register any additional transpose functions */
     registerTransFunction(trans, trans_desc); 
+    registerTransFunction(trans_blocked, trans_blocked_desc);
+    registerTransFunction(trans_recursive, trans_recursive_desc);
+#ifdef __x86_64__
+    registerTransFunction(trans_sse2, trans_sse2_desc);
+    if (__builtin_cpu_supports("avx2")) {
+        registerTransFunction(trans_avx2, trans_avx2_desc);
+    }
+#endif
+    registerInPlaceTransFunction(trans_in_place_square, trans_in_place_square_desc);
+    registerInPlaceTransFunction(trans_in_place, trans_in_place_desc);
+    registerParallelTransFunction(trans_par_blocked, trans_par_blocked_desc);
+#ifdef __x86_64__
+    registerParallelTransFunction(trans_par_sse2, trans_par_sse2_desc);
+#endif
 
 }
 